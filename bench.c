@@ -0,0 +1,160 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Count every allocation made by the library
+static long n_allocs = 0;
+
+static void *count_malloc(size_t size)
+{
+    n_allocs++;
+    return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+    n_allocs++;
+    return realloc(ptr, size);
+}
+
+#define PLT_MALLOC count_malloc
+#define PLT_REALLOC count_realloc
+#define PLT_FREE free
+
+#include "cplotgibb.h"
+
+/*
+ * Throughput of the three stages of a save, as CSV on stdout:
+ *   ingest  plt_plot copying n points into the figure
+ *   format  write_series turning the points into text (output discarded)
+ *   save    plt_save_fig end to end, into a file
+ * for total sizes 10^3 ... max_points split over 1 and 10 series.
+ *
+ * usage: ./plt_bench [max_points] [scratch_file]
+ */
+
+#define BENCH_MIN_POINTS 1000
+// Small sizes are repeated until about this many points have been timed
+#define BENCH_POINTS_PER_ROW 10000000.
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+// Counts the formatted bytes instead of keeping them
+void flush_discard(plt_sink *sink)
+{
+    *(size_t *)sink->ctx += sink->len;
+    sink->len = 0;
+}
+
+plt *make_figure(char *path, double *x, double *y, long points, int series)
+{
+    plt *figure = plt_figure(path);
+    int n = (int)(points / series);
+
+    for (int s = 0; s < series; s++)
+    {
+        plt_plot(figure, x + (long)s * n, y + (long)s * n, n, "blue", "");
+    }
+    return figure;
+}
+
+void report(const char *stage, int series, long points, int reps,
+            double seconds, double bytes, long allocs)
+{
+    double run = seconds / reps;
+    printf("%s,%d,%ld,%d,%.6f,%.0f,%.2f,%ld\n", stage, series, points, reps,
+           run, (double)points / run, bytes / reps / run / 1e6,
+           allocs / reps);
+    fflush(stdout);
+}
+
+void bench(char *path, double *x, double *y, long points, int series)
+{
+    int reps = (int)ceil(BENCH_POINTS_PER_ROW / (double)points);
+    double t_ingest = 0., t_format = 0., t_save = 0.;
+    double format_bytes = 0., save_bytes = 0.;
+    long a_ingest = 0, a_format = 0, a_save = 0;
+
+    for (int r = 0; r < reps; r++)
+    {
+        size_t bytes = 0;
+        plt_sink sink;
+        struct stat st;
+
+        long a0 = n_allocs;
+        double t0 = now();
+        plt *figure = make_figure(path, x, y, points, series);
+        t_ingest += now() - t0;
+        a_ingest += n_allocs - a0;
+
+        sink_init(&sink, PLT_SINK_CHUNK);
+        sink.flush = flush_discard;
+        sink.ctx = &bytes;
+        a0 = n_allocs;
+        t0 = now();
+        write_series(&sink, figure, 0);
+        sink_close(&sink);
+        t_format += now() - t0;
+        a_format += n_allocs - a0;
+        format_bytes += (double)bytes;
+        plt_close(figure);
+
+        figure = make_figure(path, x, y, points, series);
+        a0 = n_allocs;
+        t0 = now();
+        plt_save_fig(figure);
+        t_save += now() - t0;
+        a_save += n_allocs - a0;
+        stat(path, &st);
+        save_bytes += (double)st.st_size;
+    }
+
+    // Ingest reads 16 bytes a point
+    double ingest_bytes = 16. * (double)points * reps;
+    report("ingest", series, points, reps, t_ingest, ingest_bytes, a_ingest);
+    report("format", series, points, reps, t_format, format_bytes, a_format);
+    report("save", series, points, reps, t_save, save_bytes, a_save);
+}
+
+int main(int argc, char **argv)
+{
+    long max_points = argc > 1 ? atol(argv[1]) : 100000000;
+    char *path = argc > 2 ? argv[2] : "bench.tikz";
+
+    if (max_points < BENCH_MIN_POINTS || max_points > INT_MAX)
+    {
+        printf("ERROR: max_points must be between %d and %d\n",
+               BENCH_MIN_POINTS, INT_MAX);
+        return 1;
+    }
+
+    double *x = (double *)malloc(sizeof(double) * (size_t)max_points);
+    double *y = (double *)malloc(sizeof(double) * (size_t)max_points);
+    for (long i = 0; i < max_points; i++)
+    {
+        x[i] = 1e-3 * (double)i;
+        y[i] = exp(-x[i] / 8) * sin(2 * x[i]);
+    }
+
+    printf("stage,series,points,reps,seconds,points_per_s,mb_per_s,"
+           "allocs\n");
+    for (long points = BENCH_MIN_POINTS; points <= max_points; points *= 10)
+    {
+        bench(path, x, y, points, 1);
+        bench(path, x, y, points, 10);
+    }
+
+    unlink(path);
+    free(x);
+    free(y);
+    return 0;
+}
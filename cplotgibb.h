@@ -12,10 +12,415 @@
 #ifndef CPLOTGIBB_H
 #define CPLOTGIBB_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PLT_HAVE_AVX2
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#ifdef PLT_USE_ZLIB
+#include <zlib.h>
+#endif
+
+// Default number of decimals written per coordinate (matches "%f")
+#define PLT_DEFAULT_PRECISION 6
+#define PLT_MAX_PRECISION 9
+// Integers are exact in a double below this magnitude (2^53)
+#define PLT_INTEGRAL_LIMIT 9007199254740992.
+// Longest text fmt_fixed can produce ("%.9f" of -DBL_MAX)
+#define PLT_FMT_MAX 330
+// Default output chunk handed to each write() call
+#define PLT_SINK_CHUNK (1 << 20)
+
+// Output resolution used to size decimation buckets
+#define PLT_DEFAULT_DPI 300.
+// pgfplots' default axis width (240pt) and height (207pt) in cm
+#define PLT_DEFAULT_WIDTH 8.433
+#define PLT_DEFAULT_HEIGHT 7.275
+
+// Upper bound for plt_set_threads
+#define PLT_MAX_THREADS 256
+// Points per independently formatted chunk when saving in parallel
+#define PLT_PARALLEL_CHUNK 65536
+
+// Default size of each plt_arena block
+#define PLT_ARENA_BLOCK (1 << 20)
+
+// Heap functions used for every allocation; define all three before
+// including this header to count or redirect them
+#ifndef PLT_MALLOC
+#define PLT_MALLOC malloc
+#define PLT_REALLOC realloc
+#define PLT_FREE free
+#endif
+
+#ifdef PLT_STATS
+/*
+ * Figures of one save, filled in by every save function once plt_set_stats
+ * has been called on the figure.  Only built with PLT_STATS; otherwise the
+ * instrumentation compiles away.
+ */
+typedef struct plt_stats
+{
+    double ingest_seconds; // copying points in, since the figure was made
+    double select_seconds; // clipping and decimation
+    double format_seconds; // points to text
+    double write_seconds;  // handing text to files, streams or callbacks
+    double total_seconds;  // the whole save
+    size_t bytes;          // bytes written (after compression)
+    long points_stored;
+    long points_emitted;
+    long points_dropped; // clipped or decimated away
+    // Heap calls and the most memory in use above that at the start of the
+    // save.  The counters are process-wide, so they also include other
+    // figures saved at the same time.
+    long allocs;
+    size_t peak_bytes;
+} plt_stats;
+
+#define PLT_STAT(...) __VA_ARGS__
+
+/*
+ * Sizes of the live blocks, keyed by address, so that live memory can be
+ * tracked while every block stays plain PLT_MALLOC memory: buffers handed
+ * to callers may still be released with free().  Open addressing in a
+ * power-of-two table, guarded by plt_heap_lock.
+ */
+typedef struct plt_heap_entry
+{
+    void *ptr;
+    size_t size;
+} plt_heap_entry;
+
+static pthread_mutex_t plt_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static plt_heap_entry *plt_heap_table = NULL;
+static size_t plt_heap_slots = 0;
+static size_t plt_heap_used = 0;
+
+static long plt_heap_allocs = 0;
+static size_t plt_heap_live = 0;
+static size_t plt_heap_peak = 0;
+// Stats of the save running on this thread, NULL when none
+static __thread plt_stats *plt_stats_active = NULL;
+static __thread plt_stats plt_stats_scratch;
+
+static inline void heap_grow(size_t size)
+{
+    size_t live = __atomic_add_fetch(&plt_heap_live, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&plt_heap_peak, __ATOMIC_RELAXED);
+
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&plt_heap_peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static inline size_t heap_slot(const void *ptr)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(hash >> 32) & (plt_heap_slots - 1);
+}
+
+static void heap_insert(void *ptr, size_t size);
+
+// Doubles the table once it is half full
+static void heap_reserve(void)
+{
+    if (2 * (plt_heap_used + 1) <= plt_heap_slots)
+    {
+        return;
+    }
+
+    plt_heap_entry *old = plt_heap_table;
+    size_t old_slots = plt_heap_slots;
+    plt_heap_slots = old_slots > 0 ? 2 * old_slots : 256;
+    plt_heap_table = (plt_heap_entry *)PLT_MALLOC(sizeof(plt_heap_entry) *
+                                                  plt_heap_slots);
+    if (plt_heap_table == NULL)
+    {
+        printf("ERROR: out of memory\n");
+        exit(1);
+    }
+    memset(plt_heap_table, 0, sizeof(plt_heap_entry) * plt_heap_slots);
+    plt_heap_used = 0;
+
+    for (size_t i = 0; i < old_slots; i++)
+    {
+        if (old[i].ptr != NULL)
+        {
+            heap_insert(old[i].ptr, old[i].size);
+        }
+    }
+    PLT_FREE(old);
+}
+
+static void heap_insert(void *ptr, size_t size)
+{
+    heap_reserve();
+
+    size_t i = heap_slot(ptr);
+    while (plt_heap_table[i].ptr != NULL && plt_heap_table[i].ptr != ptr)
+    {
+        i = (i + 1) & (plt_heap_slots - 1);
+    }
+    if (plt_heap_table[i].ptr == ptr)
+    {
+        // The old block went to free() directly and the address came back
+        __atomic_sub_fetch(&plt_heap_live, plt_heap_table[i].size,
+                           __ATOMIC_RELAXED);
+    }
+    else
+    {
+        plt_heap_used++;
+    }
+    plt_heap_table[i].ptr = ptr;
+    plt_heap_table[i].size = size;
+}
+
+// Drops ptr from the table and returns its size, 0 if it is not in it
+static size_t heap_remove(void *ptr)
+{
+    if (plt_heap_slots == 0)
+    {
+        return 0;
+    }
+
+    size_t mask = plt_heap_slots - 1;
+    size_t i = heap_slot(ptr);
+    while (plt_heap_table[i].ptr != ptr)
+    {
+        if (plt_heap_table[i].ptr == NULL)
+        {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    size_t size = plt_heap_table[i].size;
+
+    // Moves later entries of the probe run back into the hole
+    for (size_t j = (i + 1) & mask; plt_heap_table[j].ptr != NULL;
+         j = (j + 1) & mask)
+    {
+        size_t home = heap_slot(plt_heap_table[j].ptr);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            plt_heap_table[i] = plt_heap_table[j];
+            i = j;
+        }
+    }
+    plt_heap_table[i].ptr = NULL;
+    plt_heap_used--;
+    return size;
+}
+
+static void *stats_malloc(size_t size)
+{
+    void *ptr = PLT_MALLOC(size > 0 ? size : 1);
+    if (ptr == NULL)
+    {
+        printf("ERROR: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&plt_heap_lock);
+    heap_insert(ptr, size);
+    pthread_mutex_unlock(&plt_heap_lock);
+
+    __atomic_add_fetch(&plt_heap_allocs, 1, __ATOMIC_RELAXED);
+    heap_grow(size);
+    return ptr;
+}
+
+static void *stats_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return stats_malloc(size);
+    }
+
+    pthread_mutex_lock(&plt_heap_lock);
+    size_t old_size = heap_remove(ptr);
+    pthread_mutex_unlock(&plt_heap_lock);
+
+    void *fresh = PLT_REALLOC(ptr, size > 0 ? size : 1);
+    if (fresh == NULL)
+    {
+        printf("ERROR: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&plt_heap_lock);
+    heap_insert(fresh, size);
+    pthread_mutex_unlock(&plt_heap_lock);
+
+    __atomic_add_fetch(&plt_heap_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&plt_heap_live, old_size, __ATOMIC_RELAXED);
+    heap_grow(size);
+    return fresh;
+}
+
+static void stats_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        pthread_mutex_lock(&plt_heap_lock);
+        size_t size = heap_remove(ptr);
+        pthread_mutex_unlock(&plt_heap_lock);
+
+        __atomic_sub_fetch(&plt_heap_live, size, __ATOMIC_RELAXED);
+        PLT_FREE(ptr);
+    }
+}
+
+// From here on the library allocates through the counting versions
+#undef PLT_MALLOC
+#undef PLT_REALLOC
+#undef PLT_FREE
+#define PLT_MALLOC stats_malloc
+#define PLT_REALLOC stats_realloc
+#define PLT_FREE stats_free
+
+static inline double plt_clock(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+// Stats of the running save, or a scratch copy that nobody reads
+static inline plt_stats *stats_current(void)
+{
+    return plt_stats_active != NULL ? plt_stats_active : &plt_stats_scratch;
+}
+
+// Accounts for a write to the destination that started at start
+static inline void stats_write(double start, size_t bytes)
+{
+    plt_stats *stats = stats_current();
+    stats->write_seconds += plt_clock() - start;
+    stats->bytes += bytes;
+}
+
+// A stage of a save, timed without the writes made during it
+typedef struct plt_stage
+{
+    double start;
+    double written;
+} plt_stage;
+
+static inline plt_stage stage_begin(void)
+{
+    plt_stage stage = {plt_clock(), stats_current()->write_seconds};
+    return stage;
+}
+
+static inline double stage_seconds(plt_stage stage)
+{
+    double written = stats_current()->write_seconds - stage.written;
+    return plt_clock() - stage.start - written;
+}
+#else
+#define PLT_STAT(...)
+#endif
+
+typedef struct plt_arena_block
+{
+    struct plt_arena_block *next;
+    size_t size;
+    size_t used;
+    max_align_t mem[];
+} plt_arena_block;
+
+/*
+ * Bump allocator for figures and their series.  Nothing is freed
+ * individually; plt_arena_reset recycles every block at once.
+ */
+typedef struct plt_arena
+{
+    plt_arena_block *head;
+    plt_arena_block *current;
+    size_t block_size;
+} plt_arena;
+
+/*
+ * Points of a series that are written out: either every index in
+ * [begin, end), or the count entries of index when index is not NULL.
+ */
+typedef struct plt_points
+{
+    int begin;
+    int end;
+    int *index;
+    int count;
+} plt_points;
+
+// Column flags for add_series
+#define PLT_COPY_X 1
+#define PLT_COPY_Y 2
+#define PLT_COPY_XY (PLT_COPY_X | PLT_COPY_Y)
+
+/*
+ * Output sink shared by every writer.  Text accumulates in buf; once it
+ * holds cap bytes it is handed to flush, or, for sinks without a flush
+ * callback, the buffer simply grows.
+ */
+typedef struct plt_sink
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    void (*flush)(struct plt_sink *sink);
+    void *ctx;
+    int fd;
+} plt_sink;
+
+// Element types accepted for series columns
+typedef enum plt_dtype
+{
+    PLT_F64,
+    PLT_F32,
+    PLT_I16,
+    PLT_I32,
+    // No array: value i is start + i * step
+    PLT_UNIFORM
+} plt_dtype;
+
+// One coordinate array: value i is read from ptr + i * stride bytes
+typedef struct plt_column
+{
+    const char *ptr;
+    size_t stride;
+    plt_dtype dtype;
+    double start;
+    double step;
+} plt_column;
+
+// How the coordinates of a series are written, resolved at each save
+typedef struct plt_number
+{
+    // Decimals of x and of y
+    int precision[2];
+    // Trailing zeros of the fraction are dropped
+    unsigned char trim;
+    // x, y columns holding only integers, written without a fraction
+    unsigned char integral[2];
+} plt_number;
 
 typedef struct plot_data
 {
@@ -23,327 +428,5235 @@ typedef struct plot_data
     char type[100];
     char color[20];
     char legend[50];
-    struct plot_data *next;
+    // Points read at save time: either data[] or the caller's arrays
+    plt_column x;
+    plt_column y;
+    // Decimation override ("" follows the figure)
+    char decimate[10];
+    // Opacity of each point when the series is drawn as an image, 0 when
+    // it is written point by point
+    double raster;
+    // Precision policy override ("" follows the figure), and the number
+    // format it gave for the current save and for the cached text
+    char precision_policy[10];
+    plt_number number;
+    plt_number cached_number;
+    // 1 if x never decreases, 0 if it does, -1 before it is known
+    signed char sorted;
+    // {xmin, xmax, ymin, ymax} of the points, NaNs skipped (has_nan set);
+    // valid while bounded is 1
+    double bounds[4];
+    signed char bounded;
+    unsigned char has_nan;
+    // 1 if the x, y column holds only integers, 0 if not, -1 before it is
+    // known
+    signed char integral[2];
+    // Points chosen for output by select_points, valid during a save
+    plt_points points;
+    // Growable copy used by plt_update_series/plt_append_points: x in
+    // [0, capacity), y in [capacity, 2 * capacity)
+    double *store;
+    int capacity;
+    // Coordinate text kept between saves of a kept figure.  It holds the
+    // first cached_points points when the selection was every point, or
+    // cached_points is -1 when it was a clipped or decimated subset.
+    plt_sink cache;
+    int cached_points;
+    unsigned long cached_generation;
+    // Axis window the cached text was simplified in by "rdp" or "vw"
+    double cached_window[4];
+    // 0 unchanged since cached, 1 points appended, 2 points replaced
+    unsigned char dirty;
+    // Part of a file mapped by plt_series_mmap that the columns point into
+    void *mapping;
+    size_t mapping_len;
+    // Owned copies of the columns, stored one after the other (x first)
     double data[0];
 } plot_data;
 
-typedef struct plt
+static inline plt_column plt_col(const void *ptr, plt_dtype dtype,
+                                 size_t stride)
+{
+    plt_column column = {(const char *)ptr, stride, dtype, 0., 0.};
+    return column;
+}
+
+static inline plt_column plt_col_uniform(double start, double step)
+{
+    plt_column column = {NULL, 0, PLT_UNIFORM, start, step};
+    return column;
+}
+
+static inline plt_column plt_col_f64(const double *values)
+{
+    return plt_col(values, PLT_F64, sizeof(double));
+}
+
+static inline double column_at(const plt_column *column, int i)
+{
+    const char *p = column->ptr + (size_t)i * column->stride;
+
+    switch (column->dtype)
+    {
+    case PLT_F32:
+        return *(const float *)p;
+    case PLT_I16:
+        return *(const int16_t *)p;
+    case PLT_I32:
+        return *(const int32_t *)p;
+    case PLT_UNIFORM:
+        return column->start + i * column->step;
+    default:
+        return *(const double *)p;
+    }
+}
+
+static inline double series_x(const plot_data *data_in, int i)
+{
+    return column_at(&data_in->x, i);
+}
+
+static inline double series_y(const plot_data *data_in, int i)
+{
+    return column_at(&data_in->y, i);
+}
+
+/*
+ * Widens [*lo, *hi] over n doubles, skipping NaNs.  Returns 1 if any value
+ * was NaN.  Two vectors per step keep both SIMD units busy.
+ */
+int minmax_f64(const double *v, size_t n, double *lo, double *hi)
+{
+    double l = *lo;
+    double h = *hi;
+    int nan = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    // minpd/maxpd return their second operand when either is NaN
+    __m128d l0 = _mm_set1_pd(l), l1 = l0;
+    __m128d h0 = _mm_set1_pd(h), h1 = h0;
+    __m128d unordered = _mm_setzero_pd();
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128d a = _mm_loadu_pd(v + i);
+        __m128d b = _mm_loadu_pd(v + i + 2);
+        l0 = _mm_min_pd(a, l0);
+        l1 = _mm_min_pd(b, l1);
+        h0 = _mm_max_pd(a, h0);
+        h1 = _mm_max_pd(b, h1);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(a, b));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(l0, l1));
+    l = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    _mm_storeu_pd(lanes, _mm_max_pd(h0, h1));
+    h = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    nan = _mm_movemask_pd(unordered) != 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // The "nm" forms return the number when one operand is NaN
+    float64x2_t l0 = vdupq_n_f64(l), l1 = l0;
+    float64x2_t h0 = vdupq_n_f64(h), h1 = h0;
+    uint64x2_t ordered = vdupq_n_u64(~0ull);
+    for (; i + 4 <= n; i += 4)
+    {
+        float64x2_t a = vld1q_f64(v + i);
+        float64x2_t b = vld1q_f64(v + i + 2);
+        l0 = vminnmq_f64(l0, a);
+        l1 = vminnmq_f64(l1, b);
+        h0 = vmaxnmq_f64(h0, a);
+        h1 = vmaxnmq_f64(h1, b);
+        ordered = vandq_u64(ordered, vandq_u64(vceqq_f64(a, a),
+                                               vceqq_f64(b, b)));
+    }
+    l = vminnmvq_f64(vminnmq_f64(l0, l1));
+    h = vmaxnmvq_f64(vmaxnmq_f64(h0, h1));
+    nan = (vgetq_lane_u64(ordered, 0) & vgetq_lane_u64(ordered, 1)) == 0;
+#endif
+
+    for (; i < n; i++)
+    {
+        l = v[i] < l ? v[i] : l;
+        h = v[i] > h ? v[i] : h;
+        nan |= v[i] != v[i];
+    }
+    *lo = l;
+    *hi = h;
+    return nan;
+}
+
+// minmax_f64 over the first n values of any column
+int column_minmax(const plt_column *column, int n, double *lo, double *hi)
+{
+    if (column->dtype == PLT_F64 && column->stride == sizeof(double))
+    {
+        return minmax_f64((const double *)column->ptr, (size_t)n, lo, hi);
+    }
+    if (column->dtype == PLT_UNIFORM && n > 0)
+    {
+        double first = column_at(column, 0);
+        double last = column_at(column, n - 1);
+        return minmax_f64(&first, 1, lo, hi) | minmax_f64(&last, 1, lo, hi);
+    }
+
+    int nan = 0;
+    for (int i = 0; i < n; i++)
+    {
+        double v = column_at(column, i);
+        nan |= minmax_f64(&v, 1, lo, hi);
+    }
+    return nan;
+}
+
+// 1 if every value of the column is an integer of magnitude below 2^53
+int column_integral(const plt_column *column, int n)
+{
+    switch (column->dtype)
+    {
+    case PLT_I16:
+    case PLT_I32:
+        return 1;
+    case PLT_UNIFORM:
+        return column->start == floor(column->start) &&
+               column->step == floor(column->step) &&
+               fabs(column_at(column, 0)) < PLT_INTEGRAL_LIMIT &&
+               fabs(column_at(column, n > 0 ? n - 1 : 0)) <
+                   PLT_INTEGRAL_LIMIT;
+    default:
+        for (int i = 0; i < n; i++)
+        {
+            double v = column_at(column, i);
+            if (!(fabs(v) < PLT_INTEGRAL_LIMIT) || v != (double)(int64_t)v)
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+}
+
+// Bounds of every point of the series, computed when first needed
+const double *series_bounds(plot_data *data_in)
+{
+    if (!data_in->bounded)
+    {
+        double *b = data_in->bounds;
+        b[0] = b[2] = INFINITY;
+        b[1] = b[3] = -INFINITY;
+        data_in->has_nan =
+            (unsigned char)(column_minmax(&data_in->x, data_in->length,
+                                          &b[0], &b[1]) |
+                            column_minmax(&data_in->y, data_in->length,
+                                          &b[2], &b[3]));
+        data_in->bounded = 1;
+    }
+    return data_in->bounds;
+}
+
+// Shared x values registered with plt_xaxis, newest first
+typedef struct plt_axis
+{
+    struct plt_axis *next;
+    int length;
+    double data[];
+} plt_axis;
+
+typedef struct plt
+{
+    char filename[100];
+    char type[10];
+    double xmin;
+    double xmax;
+    double ymin;
+    double ymax;
+    unsigned char grid;
+    double width;
+    double height;
+    char xlabel[100];
+    char ylabel[100];
+    char legend_position[20];
+    int precision;
+    char precision_policy[10];
+    // Axis window and decimals of x and y under the "auto" policy, resolved
+    // by each save
+    double window[4];
+    int auto_precision[2];
+    char decimate[10];
+    // Tolerance in cm of "rdp" and "vw" (see plt_tolerance), 0 for half a
+    // pixel at dpi
+    double tolerance;
+    double dpi;
+    size_t buffer_size;
+    int threads;
+    char data_mode[10];
+    char compress[10];
+    char autoscale[10];
+    char backend[10];
+    int n_tables;
+    // Bumped by every setting that changes how series are written
+    unsigned long generation;
+    // Set during plt_save_fig_keep and friends: series text is cached
+    int keep;
+    // Rendered "\begin{tikzpicture}...[options]" text, NULL when stale
+    char *header;
+    size_t header_len;
+    // Series in drawing order; grows by doubling
+    plot_data **series;
+    int n_series;
+    int series_cap;
+    plt_axis *xaxis;
+    // Storage for the figure and its series, NULL for PLT_MALLOC
+    plt_arena *arena;
+    // Output of a streamed figure, NULL until plt_begin_series
+    struct plt_sink *stream;
+    int n_streamed;
+    int stream_open;
+    char stream_legend[50];
+    // File mapped by plt_load that the series point into
+    void *mapping;
+    size_t mapping_len;
+    // Subplot grid of plt_subplots, row by row, and the figure a panel
+    // belongs to
+    struct plt **panels;
+    int n_panels;
+    int panel_cols;
+    struct plt *parent;
+#ifdef PLT_STATS
+    // Filled in by each save, NULL for none
+    plt_stats *stats;
+    double ingest_seconds;
+#endif
+} plt;
+
+// Receives generated text for plt_save_to_callback
+typedef void (*plt_write_fn)(const char *data, size_t len, void *userdata);
+
+plt_arena *plt_arena_create(size_t block_size)
+{
+    plt_arena *arena = (plt_arena *)PLT_MALLOC(sizeof(*arena));
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size > 0 ? block_size : PLT_ARENA_BLOCK;
+    return arena;
+}
+
+void *plt_arena_alloc(plt_arena *arena, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    // Move on through recycled blocks until one has room
+    while (arena->current != NULL &&
+           arena->current->size - arena->current->used < size)
+    {
+        if (arena->current->next == NULL ||
+            arena->current->next->size < size)
+        {
+            break;
+        }
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+    }
+
+    if (arena->current == NULL ||
+        arena->current->size - arena->current->used < size)
+    {
+        size_t block = size > arena->block_size ? size : arena->block_size;
+        plt_arena_block *fresh =
+            (plt_arena_block *)PLT_MALLOC(sizeof(*fresh) + block);
+        fresh->size = block;
+        fresh->used = 0;
+
+        if (arena->current == NULL)
+        {
+            fresh->next = arena->head;
+            arena->head = fresh;
+        }
+        else
+        {
+            fresh->next = arena->current->next;
+            arena->current->next = fresh;
+        }
+        arena->current = fresh;
+    }
+
+    void *ptr = (char *)arena->current->mem + arena->current->used;
+    arena->current->used += size;
+    return ptr;
+}
+
+// Releases everything allocated from the arena but keeps its blocks
+void plt_arena_reset(plt_arena *arena)
+{
+    arena->current = arena->head;
+    if (arena->current != NULL)
+    {
+        arena->current->used = 0;
+    }
+}
+
+void plt_arena_destroy(plt_arena *arena)
+{
+    plt_arena_block *block = arena->head;
+
+    while (block != NULL)
+    {
+        plt_arena_block *next = block->next;
+        PLT_FREE(block);
+        block = next;
+    }
+    PLT_FREE(arena);
+}
+
+void *plt_alloc(plt *figure, size_t size)
+{
+    if (figure->arena != NULL)
+    {
+        return plt_arena_alloc(figure->arena, size);
+    }
+    return PLT_MALLOC(size);
+}
+
+void *plt_realloc(plt *figure, void *ptr, size_t old_size, size_t size)
+{
+    if (figure->arena != NULL)
+    {
+        void *fresh = plt_arena_alloc(figure->arena, size);
+        if (ptr != NULL)
+        {
+            memcpy(fresh, ptr, old_size);
+        }
+        return fresh;
+    }
+    return PLT_REALLOC(ptr, size);
+}
+
+void plt_free(plt *figure, void *ptr)
+{
+    if (figure->arena == NULL)
+    {
+        PLT_FREE(ptr);
+    }
+}
+
+// Empties a figure of series, axes, tables and stream state
+void reset_contents(plt *figure)
+{
+    figure->n_tables = 0;
+    figure->series = NULL;
+    figure->n_series = 0;
+    figure->series_cap = 0;
+    figure->xaxis = NULL;
+    figure->stream = NULL;
+    figure->n_streamed = 0;
+    figure->stream_open = 0;
+    figure->mapping = NULL;
+    figure->mapping_len = 0;
+    figure->panels = NULL;
+    figure->n_panels = 0;
+    figure->panel_cols = 0;
+    figure->parent = NULL;
+    // Clones get stats of their own through plt_set_stats
+    PLT_STAT(figure->stats = NULL;)
+    PLT_STAT(figure->ingest_seconds = 0.;)
+}
+
+void init_figure(plt *figure, char *filename, plt_arena *arena)
+{
+    strcpy(figure->filename, filename);
+    strcpy(figure->type, "standard");
+    strcpy(figure->xlabel, "");
+    strcpy(figure->ylabel, "");
+    strcpy(figure->legend_position, "");
+    figure->xmin = 0.;
+    figure->xmax = 0.;
+    figure->ymin = 0.;
+    figure->ymax = 0.;
+    figure->grid = 0;
+    figure->width = 0.;
+    figure->height = 0.;
+    figure->precision = PLT_DEFAULT_PRECISION;
+    strcpy(figure->precision_policy, "fixed");
+    figure->window[0] = figure->window[2] = -INFINITY;
+    figure->window[1] = figure->window[3] = INFINITY;
+    figure->auto_precision[0] = PLT_DEFAULT_PRECISION;
+    figure->auto_precision[1] = PLT_DEFAULT_PRECISION;
+    strcpy(figure->decimate, "none");
+    figure->tolerance = 0.;
+    figure->dpi = PLT_DEFAULT_DPI;
+    figure->buffer_size = PLT_SINK_CHUNK;
+    figure->threads = 1;
+    strcpy(figure->data_mode, "inline");
+    strcpy(figure->compress, "auto");
+    strcpy(figure->autoscale, "none");
+    strcpy(figure->backend, "pgfplots");
+    figure->arena = arena;
+    figure->header = NULL;
+    figure->header_len = 0;
+    figure->generation = 1;
+    figure->keep = 0;
+    reset_contents(figure);
+}
+
+plt *plt_figure(char *filename)
+{
+    plt *figure = (plt *)PLT_MALLOC(sizeof(*figure));
+    init_figure(figure, filename, NULL);
+
+    return figure;
+}
+
+// Figure whose struct, series and points all live in arena.  Saving it
+// frees nothing; call plt_arena_reset once the figure has been saved.
+plt *plt_figure_in_arena(plt_arena *arena, char *filename)
+{
+    plt *figure = (plt *)plt_arena_alloc(arena, sizeof(*figure));
+    init_figure(figure, filename, arena);
+
+    return figure;
+}
+
+// Drops the cached axis header; every setter that changes it calls this
+void invalidate_header(plt *figure)
+{
+    figure->generation++;
+    PLT_FREE(figure->header);
+    figure->header = NULL;
+    figure->header_len = 0;
+}
+
+void plt_axes_type(plt *figure, char *type)
+{
+    invalidate_header(figure);
+    strcpy(figure->type, type);
+}
+
+void plt_xlim(plt *figure, double xmin, double xmax)
+{
+    invalidate_header(figure);
+    figure->xmin = xmin;
+    figure->xmax = xmax;
+}
+
+void plt_ylim(plt *figure, double ymin, double ymax)
+{
+    invalidate_header(figure);
+    figure->ymin = ymin;
+    figure->ymax = ymax;
+}
+
+void plt_dims(plt *figure, double width, double height)
+{
+    invalidate_header(figure);
+    figure->width = width;
+    figure->height = height;
+}
+
+void plt_grid(plt *figure)
+{
+    invalidate_header(figure);
+    figure->grid = 1;
+}
+
+void plt_xlabel(plt *figure, char *xlabel)
+{
+    invalidate_header(figure);
+    strcpy(figure->xlabel, xlabel);
+}
+
+void plt_ylabel(plt *figure, char *ylabel)
+{
+    invalidate_header(figure);
+    strcpy(figure->ylabel, ylabel);
+}
+
+void plt_legend_pos(plt *figure, char *position)
+{
+    invalidate_header(figure);
+    strcpy(figure->legend_position, position);
+}
+
+void plt_precision(plt *figure, int digits)
+{
+    if (digits < 0 || digits > PLT_MAX_PRECISION)
+    {
+        printf("ERROR: precision must be between 0 and %d\n",
+               PLT_MAX_PRECISION);
+        exit(1);
+    }
+    figure->precision = digits;
+    figure->generation++;
+}
+
+void check_precision_policy(const char *policy)
+{
+    if (strcmp(policy, "fixed") != 0 && strcmp(policy, "trim") != 0 &&
+        strcmp(policy, "auto") != 0)
+    {
+        printf("ERROR: %s invalid precision policy!\n", policy);
+        exit(1);
+    }
+}
+
+// How coordinates are written: "fixed" with plt_precision decimals,
+// "trim" dropping their trailing zeros, or "auto" with the decimals that
+// resolve a tenth of a pixel at plt_dims and plt_dpi, trimmed.  Under
+// "trim" and "auto" columns of integers are written as integers.
+void plt_precision_policy(plt *figure, char *policy)
+{
+    check_precision_policy(policy);
+    figure->generation++;
+    strcpy(figure->precision_policy, policy);
+}
+
+// Precision policy of one series, "" to follow the figure
+void plt_series_precision_policy(plot_data *series, char *policy)
+{
+    if (strcmp(policy, "") != 0)
+    {
+        check_precision_policy(policy);
+    }
+    series->dirty = 2;
+    strcpy(series->precision_policy, policy);
+}
+
+// Point reduction applied when saving: "none", "minmax" (first, min, max
+// and last point of every pixel column) or "lttb" (Largest-Triangle-
+// Three-Buckets), whose pixel grid follows the axis width and plt_dpi, or
+// the simplification of plot series by plt_tolerance: "rdp"
+// (Ramer-Douglas-Peucker, dropped points within the tolerance of the line)
+// or "vw" (Visvalingam-Whyatt, dropped triangles below tolerance^2).
+void plt_decimate(plt *figure, char *method)
+{
+    figure->generation++;
+    strcpy(figure->decimate, method);
+}
+
+void plt_series_decimate(plot_data *series, char *method)
+{
+    series->dirty = 2;
+    strcpy(series->decimate, method);
+}
+
+// Draws series as an image in which each point covers its pixel with
+// opacity alpha in (0, 1]; 0 writes its points again
+void plt_series_rasterize(plot_data *series, double alpha)
+{
+    if (!(alpha >= 0. && alpha <= 1.))
+    {
+        printf("ERROR: %g invalid raster opacity!\n", alpha);
+        exit(1);
+    }
+    series->dirty = 2;
+    series->raster = alpha;
+}
+
+// Tolerance of "rdp" and "vw" in cm on the page, 0 for half a pixel: the
+// farthest "rdp" lets a dropped point lie from the line, and for "vw" the
+// side of the square whose area a dropped triangle stays below
+void plt_tolerance(plt *figure, double cm)
+{
+    if (!(cm >= 0.))
+    {
+        printf("ERROR: %g invalid tolerance!\n", cm);
+        exit(1);
+    }
+    figure->generation++;
+    figure->tolerance = cm;
+}
+
+void plt_dpi(plt *figure, double dpi)
+{
+    figure->generation++;
+    figure->dpi = dpi;
+}
+
+// Where points are written: "inline" coordinates in the picture, or
+// "table" side files that the picture loads with \addplot table
+void plt_data_mode(plt *figure, char *mode)
+{
+    strcpy(figure->data_mode, mode);
+}
+
+// Output compression: "gzip", "none", or "auto" (gzip when the filename
+// ends in ".gz").  Compressed files always get a ".gz" suffix; table side
+// files follow the figure and keep their ".dat" name in the picture.
+void plt_compress(plt *figure, char *method)
+{
+    if (strcmp(method, "auto") != 0 && strcmp(method, "none") != 0 &&
+        strcmp(method, "gzip") != 0)
+    {
+        printf("ERROR: %s invalid compression!\n", method);
+        exit(1);
+    }
+#ifndef PLT_USE_ZLIB
+    if (strcmp(method, "gzip") == 0)
+    {
+        printf("ERROR: gzip output needs PLT_USE_ZLIB and -lz\n");
+        exit(1);
+    }
+#endif
+    strcpy(figure->compress, method);
+}
+
+#ifdef PLT_STATS
+// Has every later save of figure fill in *stats (NULL: stop)
+void plt_set_stats(plt *figure, plt_stats *stats)
+{
+    figure->stats = stats;
+}
+#endif
+
+// Axis limits the user has not set: "none" leaves them to pgfplots,
+// "tight" writes the data bounds and "nice" widens those to multiples of
+// a 1, 2 or 5 step.  Streamed points are not included.
+void plt_autoscale(plt *figure, char *mode)
+{
+    if (strcmp(mode, "none") != 0 && strcmp(mode, "tight") != 0 &&
+        strcmp(mode, "nice") != 0)
+    {
+        printf("ERROR: %s invalid autoscale mode!\n", mode);
+        exit(1);
+    }
+    invalidate_header(figure);
+    strcpy(figure->autoscale, mode);
+}
+
+// Output format: "pgfplots" axis environments, or "tikz" paths already
+// mapped to the canvas, which TeX draws without any coordinate parsing
+void plt_backend(plt *figure, char *backend)
+{
+    if (strcmp(backend, "pgfplots") != 0 && strcmp(backend, "tikz") != 0)
+    {
+        printf("ERROR: %s invalid backend!\n", backend);
+        exit(1);
+    }
+    strcpy(figure->backend, backend);
+}
+
+// Threads used to format the series when saving (1: serial)
+void plt_set_threads(plt *figure, int n)
+{
+    if (n < 1 || n > PLT_MAX_THREADS)
+    {
+        printf("ERROR: thread count must be between 1 and %d\n",
+               PLT_MAX_THREADS);
+        exit(1);
+    }
+    figure->threads = n;
+}
+
+// Bytes of output gathered before each write(); 0 buffers the whole figure
+// and writes it with a single call.
+void plt_buffer_size(plt *figure, size_t bytes)
+{
+    figure->buffer_size = bytes;
+}
+
+// Preallocates room for n series so that adding them never reallocates
+void plt_reserve_series(plt *figure, int n)
+{
+    if (n > figure->series_cap)
+    {
+        figure->series = (plot_data **)plt_realloc(
+            figure, figure->series,
+            sizeof(plot_data *) * (size_t)figure->series_cap,
+            sizeof(plot_data *) * (size_t)n);
+        figure->series_cap = n;
+    }
+}
+
+void copy_column(double *dst, const plt_column *src, int n)
+{
+    if (src->dtype == PLT_F64 && src->stride == sizeof(double))
+    {
+        memcpy(dst, src->ptr, sizeof(double) * (size_t)n);
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        dst[i] = column_at(src, i);
+    }
+}
+
+// Creates a series node and appends it to the figure.  The columns named
+// in copy (PLT_COPY_X, PLT_COPY_Y) are copied into the node as doubles;
+// the others keep pointing at the caller's arrays.
+plot_data *add_columns(plt *figure, const char *type, plt_column x,
+                       plt_column y, int data_len, const char *color,
+                       const char *legend_entry, int copy)
+{
+    PLT_STAT(double start = plt_clock();)
+    size_t n = (size_t)data_len;
+    size_t columns = (size_t)((copy & PLT_COPY_X) != 0) +
+                     (size_t)((copy & PLT_COPY_Y) != 0);
+    plot_data *data_in = (plot_data *)plt_alloc(
+        figure, sizeof(*data_in) + sizeof(double) * columns * n);
+    double *stored = data_in->data;
+    data_in->length = data_len;
+    strcpy(data_in->type, type);
+    strcpy(data_in->color, color);
+    strcpy(data_in->legend, legend_entry);
+    strcpy(data_in->decimate, "");
+    data_in->raster = 0.;
+    strcpy(data_in->precision_policy, "");
+    data_in->sorted = -1;
+    data_in->bounded = 0;
+    data_in->integral[0] = data_in->integral[1] = -1;
+    data_in->points.index = NULL;
+    data_in->store = NULL;
+    data_in->capacity = 0;
+    data_in->cache.buf = NULL;
+    data_in->cached_points = -1;
+    data_in->cached_generation = 0;
+    data_in->dirty = 2;
+    data_in->mapping = NULL;
+    data_in->mapping_len = 0;
+
+    data_in->x = x;
+    data_in->y = y;
+    if (copy & PLT_COPY_X)
+    {
+        copy_column(stored, &x, data_len);
+        data_in->x = plt_col_f64(stored);
+        stored += n;
+    }
+    if (copy & PLT_COPY_Y)
+    {
+        copy_column(stored, &y, data_len);
+        data_in->y = plt_col_f64(stored);
+    }
+    if (copy == PLT_COPY_XY)
+    {
+        // Bound the copies while they are still in cache
+        series_bounds(data_in);
+    }
+
+    if (figure->n_series == figure->series_cap)
+    {
+        int cap = figure->series_cap > 0 ? 2 * figure->series_cap : 8;
+        plt_reserve_series(figure, cap);
+    }
+    figure->series[figure->n_series++] = data_in;
+    PLT_STAT(figure->ingest_seconds += plt_clock() - start;)
+
+    return data_in;
+}
+
+plot_data *add_series(plt *figure, const char *type, const double *x,
+                      const double *y, int data_len, const char *color,
+                      const char *legend_entry, int copy)
+{
+    return add_columns(figure, type, plt_col_f64(x), plt_col_f64(y),
+                       data_len, color, legend_entry, copy);
+}
+
+plot_data *plt_plot(plt *figure, double *x, double *y, int data_len,
+                    char *color, char *legend_entry)
+{
+    return add_series(figure, "plot", x, y, data_len, color, legend_entry,
+                      PLT_COPY_XY);
+}
+
+plot_data *plt_stem(plt *figure, double *x, double *y, int data_len,
+                    char *color, char *legend_entry)
+{
+    return add_series(figure, "stem", x, y, data_len, color, legend_entry,
+                      PLT_COPY_XY);
+}
+
+// Borrowing variants: x and y are not copied and must stay valid and
+// unchanged until the figure has been saved.
+plot_data *plt_plot_ref(plt *figure, const double *x, const double *y,
+                        int data_len, char *color, char *legend_entry)
+{
+    return add_series(figure, "plot", x, y, data_len, color, legend_entry, 0);
+}
+
+plot_data *plt_stem_ref(plt *figure, const double *x, const double *y,
+                        int data_len, char *color, char *legend_entry)
+{
+    return add_series(figure, "stem", x, y, data_len, color, legend_entry, 0);
+}
+
+// Moves the points of a series into its growable store, with room for at
+// least capacity points, keeping the first keep points
+void grow_store(plt *figure, plot_data *data_in, int capacity, int keep)
+{
+    if (data_in->store != NULL && capacity <= data_in->capacity)
+    {
+        return;
+    }
+
+    int cap = data_in->capacity > 0 ? 2 * data_in->capacity : 1024;
+    while (cap < capacity)
+    {
+        cap *= 2;
+    }
+
+    double *store =
+        (double *)plt_alloc(figure, sizeof(double) * 2 * (size_t)cap);
+    for (int i = 0; i < keep; i++)
+    {
+        store[i] = series_x(data_in, i);
+        store[cap + i] = series_y(data_in, i);
+    }
+    plt_free(figure, data_in->store);
+
+    data_in->store = store;
+    data_in->capacity = cap;
+    data_in->x = plt_col_f64(store);
+    data_in->y = plt_col_f64(store + cap);
+}
+
+// Replaces the points of a series with a copy of x and y
+void plt_update_series(plt *figure, plot_data *series, const double *x,
+                       const double *y, int n)
+{
+    PLT_STAT(double start = plt_clock();)
+    grow_store(figure, series, n, 0);
+    memcpy(series->store, x, sizeof(double) * (size_t)n);
+    memcpy(series->store + series->capacity, y, sizeof(double) * (size_t)n);
+    series->length = n;
+    series->sorted = -1;
+    series->bounded = 0;
+    series->integral[0] = series->integral[1] = -1;
+    series_bounds(series);
+    series->dirty = 2;
+    PLT_STAT(figure->ingest_seconds += plt_clock() - start;)
+}
+
+// Appends a copy of n points to a series
+void plt_append_points(plt *figure, plot_data *series, const double *x,
+                       const double *y, int n)
+{
+    PLT_STAT(double start = plt_clock();)
+    int length = series->length;
+
+    grow_store(figure, series, length + n, length);
+    memcpy(series->store + length, x, sizeof(double) * (size_t)n);
+    memcpy(series->store + series->capacity + length, y,
+           sizeof(double) * (size_t)n);
+
+    // Extend the sorted flag over the new points instead of rescanning
+    if (series->sorted == 1)
+    {
+        for (int i = length > 0 ? length : 1; i < length + n; i++)
+        {
+            if (!(series->store[i] >= series->store[i - 1]))
+            {
+                series->sorted = 0;
+                break;
+            }
+        }
+    }
+    for (int c = 0; c < 2; c++)
+    {
+        if (series->integral[c] == 1)
+        {
+            plt_column added = plt_col_f64(series->store +
+                                           c * series->capacity + length);
+            series->integral[c] = (signed char)column_integral(&added, n);
+        }
+    }
+    if (series->bounded)
+    {
+        double *b = series->bounds;
+        series->has_nan |= (unsigned char)(
+            minmax_f64(series->store + length, (size_t)n, &b[0], &b[1]) |
+            minmax_f64(series->store + series->capacity + length, (size_t)n,
+                       &b[2], &b[3]));
+    }
+    series->length = length + n;
+    if (series->dirty == 0)
+    {
+        series->dirty = 1;
+    }
+    PLT_STAT(figure->ingest_seconds += plt_clock() - start;)
+}
+
+// Marks a series as changed after the caller edited arrays it borrows
+void plt_touch_series(plot_data *series)
+{
+    series->sorted = -1;
+    series->bounded = 0;
+    series->integral[0] = series->integral[1] = -1;
+    series->dirty = 2;
+}
+
+// Registers x once for the series added with plt_plot_y/plt_stem_y.  The
+// values are copied; every later series of the figure points at the copy.
+void plt_xaxis(plt *figure, const double *x, int n)
+{
+    plt_axis *axis = (plt_axis *)plt_alloc(
+        figure, sizeof(*axis) + sizeof(double) * (size_t)n);
+    memcpy(axis->data, x, sizeof(double) * (size_t)n);
+    axis->length = n;
+    axis->next = figure->xaxis;
+    figure->xaxis = axis;
+}
+
+plot_data *add_series_y(plt *figure, const char *type, const double *y,
+                        const char *color, const char *legend_entry)
+{
+    if (figure->xaxis == NULL)
+    {
+        printf("ERROR: call plt_xaxis before adding y-only series\n");
+        exit(1);
+    }
+    return add_series(figure, type, figure->xaxis->data, y,
+                      figure->xaxis->length, color, legend_entry, PLT_COPY_Y);
+}
+
+// y holds one value per point of the last registered x axis
+plot_data *plt_plot_y(plt *figure, const double *y, char *color,
+                      char *legend_entry)
+{
+    return add_series_y(figure, "plot", y, color, legend_entry);
+}
+
+plot_data *plt_stem_y(plt *figure, const double *y, char *color,
+                      char *legend_entry)
+{
+    return add_series_y(figure, "stem", y, color, legend_entry);
+}
+
+// Uniformly sampled series, x = x0 + i * dx.  Only y is copied; x is
+// generated while saving.
+plot_data *plt_plot_uniform(plt *figure, double x0, double dx, const double *y,
+                            int data_len, char *color, char *legend_entry)
+{
+    return add_columns(figure, "plot", plt_col_uniform(x0, dx),
+                       plt_col_f64(y), data_len, color, legend_entry,
+                       PLT_COPY_Y);
+}
+
+plot_data *plt_stem_uniform(plt *figure, double x0, double dx, const double *y,
+                            int data_len, char *color, char *legend_entry)
+{
+    return add_columns(figure, "stem", plt_col_uniform(x0, dx),
+                       plt_col_f64(y), data_len, color, legend_entry,
+                       PLT_COPY_Y);
+}
+
+// Borrowing variants for other layouts.  The arrays are read (and
+// converted to double) while saving, so they must outlive the save.
+plot_data *plt_plot_f32(plt *figure, const float *x, const float *y,
+                        int data_len, char *color, char *legend_entry)
+{
+    return add_columns(figure, "plot", plt_col(x, PLT_F32, sizeof(float)),
+                       plt_col(y, PLT_F32, sizeof(float)), data_len, color,
+                       legend_entry, 0);
+}
+
+plot_data *plt_plot_i16(plt *figure, const int16_t *x, const int16_t *y,
+                        int data_len, char *color, char *legend_entry)
+{
+    return add_columns(figure, "plot", plt_col(x, PLT_I16, sizeof(int16_t)),
+                       plt_col(y, PLT_I16, sizeof(int16_t)), data_len, color,
+                       legend_entry, 0);
+}
+
+plot_data *plt_plot_i32(plt *figure, const int32_t *x, const int32_t *y,
+                        int data_len, char *color, char *legend_entry)
+{
+    return add_columns(figure, "plot", plt_col(x, PLT_I32, sizeof(int32_t)),
+                       plt_col(y, PLT_I32, sizeof(int32_t)), data_len, color,
+                       legend_entry, 0);
+}
+
+// Strides count elements, e.g. 2 for the I and Q halves of IQ samples
+plot_data *plt_plot_strided(plt *figure, const double *x, int xstride,
+                            const double *y, int ystride, int data_len,
+                            char *color, char *legend_entry)
+{
+    return add_columns(
+        figure, "plot", plt_col(x, PLT_F64, sizeof(double) * (size_t)xstride),
+        plt_col(y, PLT_F64, sizeof(double) * (size_t)ystride), data_len,
+        color, legend_entry, 0);
+}
+
+// General form: any column layout, any series type ("plot" or "stem")
+plot_data *plt_series_columns(plt *figure, char *type, plt_column x,
+                              plt_column y, int data_len, char *color,
+                              char *legend_entry)
+{
+    return add_columns(figure, type, x, y, data_len, color, legend_entry, 0);
+}
+
+/*
+ * Series read straight from a raw binary file.  Only the bytes the columns
+ * span are mapped, read-only and for sequential access, so the points take
+ * no heap and the kernel can drop their pages again once a save has read
+ * them.  The series owns the mapping and unmaps it when the figure is
+ * freed.  Values must be aligned to their size within the file, which
+ * must not shrink while it is mapped.
+ */
+static inline size_t dtype_size(plt_dtype dtype)
+{
+    switch (dtype)
+    {
+    case PLT_F32:
+        return sizeof(float);
+    case PLT_I16:
+        return sizeof(int16_t);
+    case PLT_I32:
+        return sizeof(int32_t);
+    default:
+        return sizeof(double);
+    }
+}
+
+// General form: x.ptr and y.ptr hold byte offsets into path, as in
+// plt_col((const void *)offset, dtype, stride); a PLT_UNIFORM x is kept
+plot_data *plt_series_mmap(plt *figure, char *type, const char *path,
+                           plt_column x, plt_column y, int data_len,
+                           char *color, char *legend_entry)
+{
+    plt_column *columns[2] = {&x, &y};
+    size_t offsets[2] = {0, 0};
+    size_t lo = SIZE_MAX;
+    size_t hi = 0;
+
+    if (data_len < 0 || y.dtype == PLT_UNIFORM)
+    {
+        printf("ERROR: %s needs a y column and a length >= 0\n", path);
+        exit(1);
+    }
+    for (int c = 0; c < 2; c++)
+    {
+        const plt_column *column = columns[c];
+        size_t size = dtype_size(column->dtype);
+        if (column->dtype == PLT_UNIFORM)
+        {
+            continue;
+        }
+
+        offsets[c] = (size_t)(uintptr_t)column->ptr;
+        if (offsets[c] % size != 0 || column->stride % size != 0)
+        {
+            printf("ERROR: values in %s must be aligned to their size\n",
+                   path);
+            exit(1);
+        }
+        size_t end = offsets[c];
+        if (data_len > 0)
+        {
+            end += (size_t)(data_len - 1) * column->stride + size;
+        }
+        lo = offsets[c] < lo ? offsets[c] : lo;
+        hi = end > hi ? end : hi;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        printf("ERROR: cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if ((size_t)info.st_size < hi)
+    {
+        printf("ERROR: %s holds %lld bytes, the series needs %zu\n", path,
+               (long long)info.st_size, hi);
+        exit(1);
+    }
+
+    // The mapping starts on the page holding the first value
+    size_t start = lo / (size_t)sysconf(_SC_PAGESIZE) *
+                   (size_t)sysconf(_SC_PAGESIZE);
+    void *mapping = NULL;
+    if (data_len > 0)
+    {
+        mapping = mmap(NULL, hi - start, PROT_READ, MAP_PRIVATE, fd,
+                       (off_t)start);
+        if (mapping == MAP_FAILED)
+        {
+            printf("ERROR: cannot map %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        madvise(mapping, hi - start, MADV_SEQUENTIAL);
+        for (int c = 0; c < 2; c++)
+        {
+            if (columns[c]->dtype != PLT_UNIFORM)
+            {
+                columns[c]->ptr = (const char *)mapping + offsets[c] - start;
+            }
+        }
+    }
+    close(fd);
+
+    plot_data *data_in = add_columns(figure, type, x, y, data_len, color,
+                                     legend_entry, 0);
+    data_in->mapping = mapping;
+    data_in->mapping_len = mapping != NULL ? hi - start : 0;
+    return data_in;
+}
+
+// Plots n values of dtype in path from byte offset on, one every stride
+// bytes (0 when packed), against their index
+plot_data *plt_plot_mmap(plt *figure, const char *path, size_t offset, int n,
+                         plt_dtype dtype, size_t stride, char *color,
+                         char *legend_entry)
+{
+    plt_column y = plt_col((const void *)(uintptr_t)offset, dtype,
+                           stride != 0 ? stride : dtype_size(dtype));
+    return plt_series_mmap(figure, "plot", path, plt_col_uniform(0., 1.), y,
+                           n, color, legend_entry);
+}
+
+static const char plt_digit_pairs[201] = "00010203040506070809"
+                                         "10111213141516171819"
+                                         "20212223242526272829"
+                                         "30313233343536373839"
+                                         "40414243444546474849"
+                                         "50515253545556575859"
+                                         "60616263646566676869"
+                                         "70717273747576777879"
+                                         "80818283848586878889"
+                                         "90919293949596979899";
+
+static const uint64_t plt_pow10[PLT_MAX_PRECISION + 1] = {
+    1ULL,      10ULL,      100ULL,      1000ULL,      10000ULL,
+    100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+
+// Writes the decimal digits of value to buf and returns the count
+int fmt_uint(char *buf, uint64_t value)
+{
+    char tmp[20];
+    int len = 0;
+
+    while (value >= 100)
+    {
+        uint64_t pair = (value % 100) * 2;
+        value /= 100;
+        tmp[19 - len++] = plt_digit_pairs[pair + 1];
+        tmp[19 - len++] = plt_digit_pairs[pair];
+    }
+    if (value >= 10)
+    {
+        tmp[19 - len++] = plt_digit_pairs[value * 2 + 1];
+        tmp[19 - len++] = plt_digit_pairs[value * 2];
+    }
+    else
+    {
+        tmp[19 - len++] = (char)('0' + value);
+    }
+
+    memcpy(buf, tmp + 20 - len, (size_t)len);
+    return len;
+}
+
+// Scaled fractions closer than this to the midpoint are rounded on the
+// exact product; the error of the rounded one stays below 2^-23
+#define PLT_TIE_WINDOW 1e-6
+
+// Whole part and rounded precision-digit fraction of magnitude < 1e19
+static inline void split_fixed(double magnitude, int precision,
+                               uint64_t *whole_out, uint64_t *frac_out)
+{
+    uint64_t whole = (uint64_t)magnitude;
+    double fraction = magnitude - (double)whole;
+    double scale = (double)plt_pow10[precision];
+    double scaled = fraction * scale;
+    uint64_t frac = (uint64_t)scaled;
+    // Both differences are exact
+    double above = (scaled - (double)frac) - 0.5;
+
+    // Near the midpoint, add the rounding error of the product, which fma
+    // gives exactly, so the sign is that of the exact remainder
+    if (fabs(above) < PLT_TIE_WINDOW)
+    {
+        above += fma(fraction, scale, -scaled);
+    }
+    // Exact ties round half to even, as printf does
+    if (above > 0 ||
+        (above == 0 && ((precision > 0 ? frac : whole + frac) & 1)))
+    {
+        frac++;
+    }
+    if (frac >= plt_pow10[precision])
+    {
+        whole++;
+        frac -= plt_pow10[precision];
+    }
+    *whole_out = whole;
+    *frac_out = frac;
+}
+
+// Fixed-point equivalent of "%.*f".  The whole part is split off exactly
+// and only the fraction is scaled; fractions that land next to a rounding
+// point are decided on the exact product, so the text is that of printf.
+// Non-finite values and magnitudes beyond 1e19 fall back to snprintf.
+int fmt_fixed(char *buf, double value, int precision)
+{
+    char *p = buf;
+    double magnitude = signbit(value) ? -value : value;
+
+    if (!(magnitude < 1e19))
+    {
+        return snprintf(buf, PLT_FMT_MAX, "%.*f", precision, value);
+    }
+
+    if (signbit(value))
+    {
+        *p++ = '-';
+    }
+
+    uint64_t whole;
+    uint64_t frac;
+    split_fixed(magnitude, precision, &whole, &frac);
+
+    p += fmt_uint(p, whole);
+
+    if (precision > 0)
+    {
+        *p++ = '.';
+        for (int i = precision - 1; i >= 0; i--)
+        {
+            p[i] = (char)('0' + frac % 10);
+            frac /= 10;
+        }
+        p += precision;
+    }
+
+    return (int)(p - buf);
+}
+
+// An integer below PLT_INTEGRAL_LIMIT, written without a fraction
+static inline char *put_integer(char *p, double value)
+{
+    if (signbit(value))
+    {
+        *p++ = '-';
+    }
+    return p + fmt_uint(p, (uint64_t)fabs(value));
+}
+
+// Drops the trailing zeros of a precision-digit fraction that ends at p,
+// and the point when no digit is left
+static inline char *trim_zeros(char *p, int precision)
+{
+    if (precision > 0)
+    {
+        while (p[-1] == '0')
+        {
+            p--;
+        }
+        p -= p[-1] == '.';
+    }
+    return p;
+}
+
+// Writes value of axis (0 for x, 1 for y) in the format number
+static inline char *put_number(char *p, double value,
+                               const plt_number *number, int axis)
+{
+    if (number->integral[axis])
+    {
+        return put_integer(p, value);
+    }
+    p += fmt_fixed(p, value, number->precision[axis]);
+    return number->trim ? trim_zeros(p, number->precision[axis]) : p;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Block formatting of coordinates, PLT_BLOCK points at a time.  The values
+ * are split into whole part and fraction exactly as fmt_fixed does, and
+ * both parts are expanded eight digits per 64-bit word (one digit a byte,
+ * the first in the lowest byte).  With AVX2, detected at run time, four
+ * values go through every step at once; otherwise each word is built with
+ * scalar multiplies.  The text is that of fmt_fixed; blocks holding a
+ * value that is not finite or whose magnitude reaches 2^52 are written by
+ * fmt_fixed itself.
+ */
+#define PLT_BLOCK_FORMAT
+#define PLT_BLOCK 4
+// Largest magnitude the block split handles: every integer below it is a
+// double, so the split can be carried out in double arithmetic
+#define PLT_BLOCK_LIMIT 4503599627370496.
+
+typedef struct plt_split
+{
+    uint64_t whole[2 * PLT_BLOCK];
+    uint64_t frac[2 * PLT_BLOCK];
+    // Digit words of whole (when below 10^8) and of the first eight
+    // fraction digits, frac scaled to eight digits
+    uint64_t whole_digits[2 * PLT_BLOCK];
+    uint64_t frac_digits[2 * PLT_BLOCK];
+    // Bit k set when value k is negative
+    int negative;
+} plt_split;
+
+// Digit word of value < 10^8: value is split into two halves of four
+// digits, then pairs, then single digits, each step in every lane at once
+static inline uint64_t digits8(uint64_t value)
+{
+    uint64_t merged = value / 10000 | (value % 10000) << 32;
+    uint64_t hundreds = (merged * 10486) >> 20 & 0x0000007f0000007fULL;
+    uint64_t pairs = (merged - 100 * hundreds) << 16 | hundreds;
+    uint64_t tens = (pairs * 103) >> 10 & 0x000f000f000f000fULL;
+
+    return (pairs - 10 * tens) << 8 | tens;
+}
+
+// The first eight digits of the precision-digit fraction frac
+static inline uint64_t frac_digits8(uint64_t frac, int precision)
+{
+    return digits8(precision > 8 ? frac / 10
+                                 : frac * plt_pow10[8 - precision]);
+}
+
+int split_block_scalar(const double *v, const int precision[2],
+                       plt_split *split)
+{
+    split->negative = 0;
+    for (int k = 0; k < 2 * PLT_BLOCK; k++)
+    {
+        double magnitude = signbit(v[k]) ? -v[k] : v[k];
+        if (!(magnitude < PLT_BLOCK_LIMIT))
+        {
+            return 0;
+        }
+        split->negative |= signbit(v[k]) ? 1 << k : 0;
+        split_fixed(magnitude, precision[k & 1], &split->whole[k],
+                    &split->frac[k]);
+        split->whole_digits[k] = digits8(split->whole[k] % 100000000);
+        split->frac_digits[k] = frac_digits8(split->frac[k], precision[k & 1]);
+    }
+    return 1;
+}
+
+#ifdef PLT_HAVE_AVX2
+#define PLT_TRUNCATE (_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+
+// digits8 of four values below 10^8
+__attribute__((target("avx2"))) static inline __m256i
+digits8_avx2(__m256i value)
+{
+    __m256i high = _mm256_srli_epi64(
+        _mm256_mul_epu32(value, _mm256_set1_epi64x(0xd1b71759)), 45);
+    __m256i low = _mm256_sub_epi64(
+        value, _mm256_mul_epu32(high, _mm256_set1_epi64x(10000)));
+    __m256i merged = _mm256_or_si256(high, _mm256_slli_epi64(low, 32));
+
+    __m256i hundreds = _mm256_srli_epi32(
+        _mm256_mullo_epi32(merged, _mm256_set1_epi32(10486)), 20);
+    __m256i pairs = _mm256_or_si256(
+        _mm256_slli_epi32(
+            _mm256_sub_epi32(merged, _mm256_mullo_epi32(
+                                         hundreds, _mm256_set1_epi32(100))),
+            16),
+        hundreds);
+
+    __m256i tens = _mm256_srli_epi16(
+        _mm256_mullo_epi16(pairs, _mm256_set1_epi16(103)), 10);
+    return _mm256_or_si256(
+        _mm256_slli_epi16(
+            _mm256_sub_epi16(pairs,
+                             _mm256_mullo_epi16(tens, _mm256_set1_epi16(10))),
+            8),
+        tens);
+}
+
+// split_block_scalar on four values per step.  Integers stay in doubles
+// until they are read back from the low mantissa bits.
+__attribute__((target("avx2"))) int
+split_block_avx2(const double *v, const int precision[2], plt_split *split)
+{
+    const __m256d sign = _mm256_set1_pd(-0.);
+    const __m256d limit = _mm256_set1_pd(PLT_BLOCK_LIMIT);
+    // Lanes alternate x and y
+    const double x_scale = (double)plt_pow10[precision[0]];
+    const double y_scale = (double)plt_pow10[precision[1]];
+    const __m256d scale = _mm256_setr_pd(x_scale, y_scale, x_scale, y_scale);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d one = _mm256_set1_pd(1.);
+    const __m256d window = _mm256_set1_pd(PLT_TIE_WINDOW);
+    const __m256d magic = _mm256_set1_pd(PLT_BLOCK_LIMIT);
+    const __m256i bias = _mm256_castpd_si256(magic);
+    // Fraction to eight digits: times 10^(8 - precision), or / 10 for 9
+    const double x_widen =
+        precision[0] > 8 ? 0.1 : (double)plt_pow10[8 - precision[0]];
+    const double y_widen =
+        precision[1] > 8 ? 0.1 : (double)plt_pow10[8 - precision[1]];
+    const __m256d widen = _mm256_setr_pd(x_widen, y_widen, x_widen, y_widen);
+
+    split->negative = 0;
+    for (int b = 0; b < 2 * PLT_BLOCK; b += 4)
+    {
+        __m256d value = _mm256_loadu_pd(v + b);
+        __m256d magnitude = _mm256_andnot_pd(sign, value);
+        // Also false for NaN
+        __m256d in_range = _mm256_cmp_pd(magnitude, limit, _CMP_LT_OQ);
+        if (_mm256_movemask_pd(in_range) != 15)
+        {
+            return 0;
+        }
+        split->negative |= _mm256_movemask_pd(value) << b;
+
+        __m256d whole = _mm256_round_pd(magnitude, PLT_TRUNCATE);
+        __m256d scaled = _mm256_mul_pd(_mm256_sub_pd(magnitude, whole), scale);
+        __m256d frac = _mm256_round_pd(scaled, PLT_TRUNCATE);
+
+        // Values next to a rounding point, ties included, are left to
+        // split_fixed
+        __m256d above = _mm256_sub_pd(_mm256_sub_pd(scaled, frac), half);
+        __m256d near = _mm256_cmp_pd(_mm256_andnot_pd(sign, above), window,
+                                     _CMP_LT_OQ);
+        if (_mm256_movemask_pd(near) != 0)
+        {
+            return split_block_scalar(v, precision, split);
+        }
+        __m256d up = _mm256_cmp_pd(above, _mm256_setzero_pd(), _CMP_GT_OQ);
+        frac = _mm256_add_pd(frac, _mm256_and_pd(up, one));
+
+        __m256d carry = _mm256_cmp_pd(frac, scale, _CMP_GE_OQ);
+        whole = _mm256_add_pd(whole, _mm256_and_pd(carry, one));
+        frac = _mm256_sub_pd(frac, _mm256_and_pd(carry, scale));
+
+        // frac / 10 is exact or at least 0.1 above an integer, so the
+        // rounded product still truncates to the quotient
+        __m256d eight =
+            _mm256_round_pd(_mm256_mul_pd(frac, widen), PLT_TRUNCATE);
+
+        __m256i whole_int = _mm256_sub_epi64(
+            _mm256_castpd_si256(_mm256_add_pd(whole, magic)), bias);
+        __m256i frac_int = _mm256_sub_epi64(
+            _mm256_castpd_si256(_mm256_add_pd(frac, magic)), bias);
+        __m256i eight_int = _mm256_sub_epi64(
+            _mm256_castpd_si256(_mm256_add_pd(eight, magic)), bias);
+
+        _mm256_storeu_si256((__m256i *)(split->whole + b), whole_int);
+        _mm256_storeu_si256((__m256i *)(split->frac + b), frac_int);
+        // Lanes of 10^8 and more are garbage; put_fixed does not use them
+        _mm256_storeu_si256((__m256i *)(split->whole_digits + b),
+                            digits8_avx2(whole_int));
+        _mm256_storeu_si256((__m256i *)(split->frac_digits + b),
+                            digits8_avx2(eight_int));
+    }
+    return 1;
+}
+#endif
+
+// Splits the 2 * PLT_BLOCK values of v, x with precision[0] decimals and y
+// with precision[1]; 0 if one is out of range
+int split_block(const double *v, const int precision[2], plt_split *split)
+{
+#ifdef PLT_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return split_block_avx2(v, precision, split);
+    }
+#endif
+    return split_block_scalar(v, precision, split);
+}
+
+// Writes value k of a split block; up to 8 bytes past the text may be
+// touched
+static inline char *put_fixed(char *p, const plt_split *split, int k,
+                              int precision)
+{
+    const uint64_t zeros = 0x3030303030303030ULL;
+
+    if (split->negative & (1 << k))
+    {
+        *p++ = '-';
+    }
+    if (split->whole[k] < 100000000)
+    {
+        // Leading zero digits are shifted out, keeping the last one
+        uint64_t digits = split->whole_digits[k];
+        int skip = digits != 0 ? __builtin_ctzll(digits) / 8 : 7;
+        skip = skip < 7 ? skip : 7;
+
+        uint64_t text = (digits + zeros) >> (8 * skip);
+        memcpy(p, &text, 8);
+        p += 8 - skip;
+    }
+    else
+    {
+        p += fmt_uint(p, split->whole[k]);
+    }
+    if (precision > 0)
+    {
+        uint64_t text = split->frac_digits[k] + zeros;
+
+        *p++ = '.';
+        memcpy(p, &text, 8);
+        if (precision > 8)
+        {
+            p[8] = (char)('0' + split->frac[k] % 10);
+        }
+        p += precision;
+    }
+    return p;
+}
+
+// Writes PLT_BLOCK "    (x,y)" lines from v = {x0, y0, x1, y1, ...} in the
+// format number and returns their length.  Needs PLT_BLOCK *
+// (2 * PLT_FMT_MAX + 8) bytes.
+size_t fmt_block(char *buf, const double *v, const plt_number *number)
+{
+    plt_split split;
+    const int *precision = number->precision;
+    int integral = number->integral[0] && number->integral[1];
+    int fast = !integral && split_block(v, precision, &split);
+    char *p = buf;
+
+    for (int j = 0; j < PLT_BLOCK; j++)
+    {
+        memcpy(p, "    (", 5);
+        p += 5;
+        for (int axis = 0; axis < 2; axis++)
+        {
+            if (fast && !number->integral[axis])
+            {
+                p = put_fixed(p, &split, 2 * j + axis, precision[axis]);
+                p = number->trim ? trim_zeros(p, precision[axis]) : p;
+            }
+            else
+            {
+                p = put_number(p, v[2 * j + axis], number, axis);
+            }
+            *p++ = axis == 0 ? ',' : ')';
+        }
+        *p++ = '\n';
+    }
+    return (size_t)(p - buf);
+}
+#endif
+
+void write_fd(int fd, const void *data, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = write(fd, (const char *)data + done, len - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("ERROR: write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        done += (size_t)n;
+    }
+    PLT_STAT(stats_current()->bytes += len;)
+}
+
+void sink_flush_fd(plt_sink *sink)
+{
+    PLT_STAT(double start = plt_clock();)
+    write_fd(sink->fd, sink->buf, sink->len);
+    sink->len = 0;
+    PLT_STAT(stats_write(start, 0);)
+}
+
+void sink_init(plt_sink *sink, size_t cap)
+{
+    sink->cap = cap > 4096 ? cap : 4096;
+    sink->buf = (char *)PLT_MALLOC(sink->cap);
+    sink->len = 0;
+    sink->flush = NULL;
+    sink->ctx = NULL;
+    sink->fd = -1;
+}
+
+// Sink writing to fd in chunks of chunk bytes (0: one write at close)
+void sink_init_fd(plt_sink *sink, int fd, size_t chunk)
+{
+    sink_init(sink, chunk);
+    if (chunk != 0)
+    {
+        sink->flush = sink_flush_fd;
+    }
+    sink->fd = fd;
+}
+
+void sink_init_memory(plt_sink *sink)
+{
+    sink_init(sink, 0);
+}
+
+// Returns space for at least n more bytes; the caller advances sink->len
+char *sink_reserve(plt_sink *sink, size_t n)
+{
+    if (sink->cap - sink->len < n && sink->flush != NULL)
+    {
+        sink->flush(sink);
+    }
+    if (sink->cap - sink->len < n)
+    {
+        while (sink->cap - sink->len < n)
+        {
+            sink->cap *= 2;
+        }
+        sink->buf = (char *)PLT_REALLOC(sink->buf, sink->cap);
+    }
+    return sink->buf + sink->len;
+}
+
+void sink_write(plt_sink *sink, const char *data, size_t len)
+{
+    memcpy(sink_reserve(sink, len), data, len);
+    sink->len += len;
+}
+
+void sink_puts(plt_sink *sink, const char *str)
+{
+    sink_write(sink, str, strlen(str));
+}
+
+void sink_printf(plt_sink *sink, const char *format, ...)
+{
+    va_list args;
+    size_t room = 256;
+
+    for (;;)
+    {
+        char *dst = sink_reserve(sink, room);
+        va_start(args, format);
+        int n = vsnprintf(dst, room, format, args);
+        va_end(args);
+
+        if ((size_t)n < room)
+        {
+            sink->len += (size_t)n;
+            return;
+        }
+        room = (size_t)n + 1;
+    }
+}
+
+// Hands any buffered text to the destination and releases the buffer
+void sink_close(plt_sink *sink)
+{
+    if (sink->fd >= 0)
+    {
+        sink_flush_fd(sink);
+    }
+    else if (sink->flush != NULL)
+    {
+        sink->flush(sink);
+    }
+    PLT_FREE(sink->buf);
+    sink->buf = NULL;
+}
+
+#ifdef PLT_USE_ZLIB
+/*
+ * gzip sink: each flush deflates the buffered text into out and writes
+ * whatever deflate produced to fd.  The deflate state lives in sink->ctx.
+ */
+#define PLT_GZIP_CHUNK (1 << 16)
+
+typedef struct plt_gzip
+{
+    z_stream stream;
+    int fd;
+    unsigned char out[PLT_GZIP_CHUNK];
+} plt_gzip;
+
+void gzip_deflate(plt_gzip *gz, const char *data, size_t len, int mode)
+{
+    do
+    {
+        // avail_in is a uInt; larger buffers go in pieces
+        uInt piece = len < (1u << 30) ? (uInt)len : (1u << 30);
+        int last = piece == len ? mode : Z_NO_FLUSH;
+
+        gz->stream.next_in = (Bytef *)data;
+        gz->stream.avail_in = piece;
+        do
+        {
+            gz->stream.next_out = gz->out;
+            gz->stream.avail_out = PLT_GZIP_CHUNK;
+            deflate(&gz->stream, last);
+            write_fd(gz->fd, gz->out, PLT_GZIP_CHUNK - gz->stream.avail_out);
+        } while (gz->stream.avail_out == 0);
+        data += piece;
+        len -= piece;
+    } while (len > 0);
+}
+
+void sink_flush_gzip(plt_sink *sink)
+{
+    PLT_STAT(double start = plt_clock();)
+    gzip_deflate((plt_gzip *)sink->ctx, sink->buf, sink->len, Z_NO_FLUSH);
+    sink->len = 0;
+    PLT_STAT(stats_write(start, 0);)
+}
+
+// Sink compressing into fd, chunk bytes of text at a time (0: default)
+void sink_init_gzip(plt_sink *sink, int fd, size_t chunk)
+{
+    plt_gzip *gz = (plt_gzip *)PLT_MALLOC(sizeof(*gz));
+
+    memset(&gz->stream, 0, sizeof(gz->stream));
+    // 15 + 16: the largest window, with a gzip header and trailer
+    if (deflateInit2(&gz->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        printf("ERROR: deflateInit2 failed\n");
+        exit(1);
+    }
+    gz->fd = fd;
+
+    sink_init(sink, chunk != 0 ? chunk : PLT_SINK_CHUNK);
+    sink->flush = sink_flush_gzip;
+    sink->ctx = gz;
+}
+
+// Deflates the remaining text, writes the gzip trailer and closes fd
+void sink_finish_gzip(plt_sink *sink)
+{
+    plt_gzip *gz = (plt_gzip *)sink->ctx;
+
+    PLT_STAT(double start = plt_clock();)
+    gzip_deflate(gz, sink->buf, sink->len, Z_FINISH);
+    deflateEnd(&gz->stream);
+    close(gz->fd);
+    PLT_STAT(stats_write(start, 0);)
+    PLT_FREE(gz);
+    PLT_FREE(sink->buf);
+    sink->buf = NULL;
+}
+#endif
+
+// Index of the k-th selected point
+static inline int point_at(const plt_points *points, int k)
+{
+    return points->index != NULL ? points->index[k] : points->begin + k;
+}
+
+// Keeps the first, lowest, highest and last point of every run of points
+// falling into the same pixel column, in their original order.
+// Pixel column of a finite x in [x0, x1]; a span too wide for a double
+// lands in the last one
+static inline long minmax_bucket(double x, double x0, double scale,
+                                 int buckets)
+{
+    double column = (x - x0) * scale;
+    return column < buckets ? (long)column : buckets;
+}
+
+int decimate_minmax(const plot_data *data_in, const plt_points *in,
+                    double x0, double x1, int buckets, int *out)
+{
+    double scale = (x1 > x0) ? buckets / (x1 - x0) : 0.;
+    int count = 0;
+    int k = 0;
+
+    while (k < in->count)
+    {
+        int i = point_at(in, k);
+        if (!isfinite(series_x(data_in, i)))
+        {
+            // Kept as a break between the columns around it
+            out[count++] = i;
+            k++;
+            continue;
+        }
+
+        long bucket = minmax_bucket(series_x(data_in, i), x0, scale, buckets);
+        int first = i;
+        int last = i;
+        int lo = i;
+        int hi = i;
+
+        while (++k < in->count)
+        {
+            i = point_at(in, k);
+            if (!isfinite(series_x(data_in, i)) ||
+                minmax_bucket(series_x(data_in, i), x0, scale, buckets) !=
+                    bucket)
+            {
+                break;
+            }
+            if (series_y(data_in, i) < series_y(data_in, lo))
+            {
+                lo = i;
+            }
+            if (series_y(data_in, i) > series_y(data_in, hi))
+            {
+                hi = i;
+            }
+            last = i;
+        }
+
+        int keep[4] = {first, lo < hi ? lo : hi, lo < hi ? hi : lo, last};
+        for (int j = 0; j < 4; j++)
+        {
+            if (count == 0 || keep[j] > out[count - 1])
+            {
+                out[count++] = keep[j];
+            }
+        }
+    }
+
+    return count;
+}
+
+// Largest-Triangle-Three-Buckets (Steinarsson, 2013) down to threshold points
+int decimate_lttb(const plot_data *data_in, const plt_points *in,
+                  int threshold, int *out)
+{
+    int n = in->count;
+    double every = (double)(n - 2) / (threshold - 2);
+    int a = point_at(in, 0);
+    int count = 0;
+
+    out[count++] = a;
+
+    for (int b = 0; b < threshold - 2; b++)
+    {
+        // Average of the next bucket is the third triangle corner
+        int next_start = (int)((b + 1) * every) + 1;
+        int next_end = (int)((b + 2) * every) + 1;
+        if (next_end > n)
+        {
+            next_end = n;
+        }
+        double avg_x = 0.;
+        double avg_y = 0.;
+        for (int k = next_start; k < next_end; k++)
+        {
+            avg_x += series_x(data_in, point_at(in, k));
+            avg_y += series_y(data_in, point_at(in, k));
+        }
+        avg_x /= next_end - next_start;
+        avg_y /= next_end - next_start;
+
+        double xa = series_x(data_in, a);
+        double ya = series_y(data_in, a);
+        double best_area = -1.;
+        int best = point_at(in, (int)(b * every) + 1);
+        for (int k = (int)(b * every) + 1; k < next_start; k++)
+        {
+            int i = point_at(in, k);
+            double xi = series_x(data_in, i);
+            double yi = series_y(data_in, i);
+            double area =
+                fabs((xa - avg_x) * (yi - ya) - (xa - xi) * (avg_y - ya));
+            if (area > best_area)
+            {
+                best_area = area;
+                best = i;
+            }
+        }
+
+        out[count++] = best;
+        a = best;
+    }
+
+    out[count++] = point_at(in, n - 1);
+    return count;
+}
+
+// {xmin, xmax, ymin, ymax} over the bounds of every series
+void data_bounds(plt *figure, double b[4])
+{
+    b[0] = b[2] = INFINITY;
+    b[1] = b[3] = -INFINITY;
+    for (int i = 0; i < figure->n_series; i++)
+    {
+        const double *series = series_bounds(figure->series[i]);
+        b[0] = series[0] < b[0] ? series[0] : b[0];
+        b[1] = series[1] > b[1] ? series[1] : b[1];
+        b[2] = series[2] < b[2] ? series[2] : b[2];
+        b[3] = series[3] > b[3] ? series[3] : b[3];
+    }
+}
+
+// {xmin, xmax, ymin, ymax} of the axes: the limits where set, else the
+// bounds of every series
+void axis_window(plt *figure, double w[4])
+{
+    data_bounds(figure, w);
+    if (figure->xmin != 0. || figure->xmax != 0.)
+    {
+        w[0] = figure->xmin;
+        w[1] = figure->xmax;
+    }
+    if (figure->ymin != 0. || figure->ymax != 0.)
+    {
+        w[2] = figure->ymin;
+        w[3] = figure->ymax;
+    }
+}
+
+/*
+ * Simplification of plot series in output units: x and y are scaled to
+ * the cm they span on the axis, so the tolerance is measured on the page.
+ * Runs of finite points are simplified on their own and non-finite points
+ * are kept, as the breaks they are.
+ *   "rdp"  Ramer-Douglas-Peucker with an explicit stack: every dropped
+ *          point lies within the tolerance of the kept polyline.
+ *          O(n log n) on smooth curves, O(n^2) at worst.
+ *   "vw"   Visvalingam-Whyatt with a binary heap: points go smallest
+ *          triangle first while the area is below tolerance^2.  The bound
+ *          is on area, not distance: a dropped point can lie farther than
+ *          the tolerance from the line.  O(n log n) at worst.
+ */
+
+// Squared distance from (x, y) to the segment (x0, y0)-(x1, y1)
+static inline double segment_distance2(double x, double y, double x0,
+                                       double y0, double x1, double y1)
+{
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double length2 = dx * dx + dy * dy;
+    double t = length2 > 0. ? ((x - x0) * dx + (y - y0) * dy) / length2 : 0.;
+
+    t = t < 0. ? 0. : t > 1. ? 1. : t;
+    double ex = x - x0 - t * dx;
+    double ey = y - y0 - t * dy;
+    return ex * ex + ey * ey;
+}
+
+// Marks in keep the points of [a, b] that RDP keeps; stack holds 2 * (b - a
+// + 1) ints
+void simplify_rdp(const double *px, const double *py, int a, int b,
+                  double tolerance, unsigned char *keep, int *stack)
+{
+    int top = 0;
+
+    memset(keep + a, 0, (size_t)(b - a + 1));
+    keep[a] = keep[b] = 1;
+    stack[top++] = a;
+    stack[top++] = b;
+    while (top > 0)
+    {
+        int end = stack[--top];
+        int start = stack[--top];
+        double worst = tolerance * tolerance;
+        int split = -1;
+
+        for (int k = start + 1; k < end; k++)
+        {
+            double d = segment_distance2(px[k], py[k], px[start], py[start],
+                                         px[end], py[end]);
+            if (d > worst)
+            {
+                worst = d;
+                split = k;
+            }
+        }
+        if (split >= 0)
+        {
+            keep[split] = 1;
+            stack[top++] = start;
+            stack[top++] = split;
+            stack[top++] = split;
+            stack[top++] = end;
+        }
+    }
+}
+
+typedef struct plt_vw_entry
+{
+    double area;
+    int k;
+} plt_vw_entry;
+
+typedef struct plt_vw
+{
+    // Min-heap of point positions by area, and the heap slot of each
+    plt_vw_entry *heap;
+    int *slot;
+    int *prev;
+    int *next;
+    int size;
+} plt_vw;
+
+// Moves entry down from slot i to its place in the subtree below it
+void vw_sift_down(plt_vw *vw, int i, plt_vw_entry entry)
+{
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= vw->size)
+        {
+            break;
+        }
+        if (child + 1 < vw->size &&
+            vw->heap[child + 1].area < vw->heap[child].area)
+        {
+            child++;
+        }
+        if (vw->heap[child].area >= entry.area)
+        {
+            break;
+        }
+        vw->heap[i] = vw->heap[child];
+        vw->slot[vw->heap[i].k] = i;
+        i = child;
+    }
+    vw->heap[i] = entry;
+    vw->slot[entry.k] = i;
+}
+
+// Moves entry up or down from slot i to its place in the heap
+void vw_place(plt_vw *vw, int i, plt_vw_entry entry)
+{
+    while (i > 0 && entry.area < vw->heap[(i - 1) / 2].area)
+    {
+        vw->heap[i] = vw->heap[(i - 1) / 2];
+        vw->slot[vw->heap[i].k] = i;
+        i = (i - 1) / 2;
+    }
+    vw_sift_down(vw, i, entry);
+}
+
+static inline double vw_area(const double *px, const double *py, int a,
+                             int k, int b)
+{
+    return 0.5 * fabs((px[a] - px[b]) * (py[k] - py[a]) -
+                      (px[a] - px[k]) * (py[b] - py[a]));
+}
+
+// Gives point k of the current polyline the area of its triangle, or the
+// area just removed when that is larger, so points go in the order of the
+// area they stand for
+static inline void vw_update(plt_vw *vw, const double *px, const double *py,
+                             int k, double removed)
+{
+    plt_vw_entry entry = {vw_area(px, py, vw->prev[k], k, vw->next[k]), k};
+    entry.area = entry.area > removed ? entry.area : removed;
+    vw_place(vw, vw->slot[k], entry);
+}
+
+// Marks in keep the points of [a, b] that VW keeps
+void simplify_vw(const double *px, const double *py, int a, int b,
+                 double tolerance, unsigned char *keep, plt_vw *vw)
+{
+    double limit = tolerance * tolerance;
+
+    keep[a] = keep[b] = 1;
+    vw->size = 0;
+    for (int k = a + 1; k < b; k++)
+    {
+        vw->prev[k] = k - 1;
+        vw->next[k] = k + 1;
+        vw->heap[vw->size].area = vw_area(px, py, k - 1, k, k + 1);
+        vw->heap[vw->size].k = k;
+        vw->slot[k] = vw->size++;
+        keep[k] = 1;
+    }
+    // Bottom-up build: every subtree below i is already a heap
+    for (int i = vw->size / 2 - 1; i >= 0; i--)
+    {
+        vw_sift_down(vw, i, vw->heap[i]);
+    }
+
+    while (vw->size > 0 && vw->heap[0].area < limit)
+    {
+        int k = vw->heap[0].k;
+        double removed = vw->heap[0].area;
+        keep[k] = 0;
+        vw->size--;
+        if (vw->size > 0)
+        {
+            vw_sift_down(vw, 0, vw->heap[vw->size]);
+        }
+
+        int p = vw->prev[k];
+        int q = vw->next[k];
+        if (p > a)
+        {
+            vw->next[p] = q;
+            vw_update(vw, px, py, p, removed);
+        }
+        if (q < b)
+        {
+            vw->prev[q] = p;
+            vw_update(vw, px, py, q, removed);
+        }
+    }
+}
+
+// Simplifies the selection of a plot series with method "rdp" or "vw";
+// writes the points kept to out and returns their count
+int simplify_points(plt *figure, const plot_data *data_in,
+                    const plt_points *in, const char *method, int *out)
+{
+    int n = in->count;
+    double w[4];
+    double width = figure->width != 0. ? figure->width : PLT_DEFAULT_WIDTH;
+    double height =
+        figure->height != 0. ? figure->height : PLT_DEFAULT_HEIGHT;
+    double tolerance = figure->tolerance != 0. ? figure->tolerance
+                                               : 1.27 / figure->dpi;
+
+    // Axes without extent are left unscaled
+    memcpy(w, figure->window, sizeof(w));
+    double sx = w[1] > w[0] && isfinite(w[1] - w[0]) ? width / (w[1] - w[0])
+                                                     : 1.;
+    double sy = w[3] > w[2] && isfinite(w[3] - w[2])
+                    ? height / (w[3] - w[2])
+                    : 1.;
+    w[0] = isfinite(w[0]) ? w[0] : 0.;
+    w[2] = isfinite(w[2]) ? w[2] : 0.;
+
+    double *px = (double *)PLT_MALLOC(sizeof(double) * 2 * (size_t)n);
+    double *py = px + n;
+    unsigned char *keep = (unsigned char *)PLT_MALLOC((size_t)n);
+    int rdp = strcmp(method, "rdp") == 0;
+    plt_vw vw;
+    int *work = (int *)PLT_MALLOC(sizeof(int) * (rdp ? 2 : 3) * (size_t)n);
+    if (!rdp)
+    {
+        vw.slot = work;
+        vw.prev = work + n;
+        vw.next = work + 2 * n;
+        vw.heap =
+            (plt_vw_entry *)PLT_MALLOC(sizeof(plt_vw_entry) * (size_t)n);
+    }
+
+    for (int k = 0; k < n; k++)
+    {
+        int i = point_at(in, k);
+        px[k] = (series_x(data_in, i) - w[0]) * sx;
+        py[k] = (series_y(data_in, i) - w[2]) * sy;
+    }
+
+    int start = 0;
+    while (start < n)
+    {
+        if (!isfinite(px[start]) || !isfinite(py[start]))
+        {
+            keep[start++] = 1;
+            continue;
+        }
+        int end = start;
+        while (end + 1 < n && isfinite(px[end + 1]) && isfinite(py[end + 1]))
+        {
+            end++;
+        }
+        if (rdp)
+        {
+            simplify_rdp(px, py, start, end, tolerance, keep, work);
+        }
+        else
+        {
+            simplify_vw(px, py, start, end, tolerance, keep, &vw);
+        }
+        start = end + 1;
+    }
+
+    int count = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (keep[k])
+        {
+            out[count++] = point_at(in, k);
+        }
+    }
+
+    if (!rdp)
+    {
+        PLT_FREE(vw.heap);
+    }
+    PLT_FREE(work);
+    PLT_FREE(keep);
+    PLT_FREE(px);
+    return count;
+}
+
+// 1 when x never decreases; computed on first use and kept per series
+int series_sorted(plot_data *data_in)
+{
+    if (data_in->sorted < 0)
+    {
+        data_in->sorted = 1;
+        for (int i = 1; i < data_in->length; i++)
+        {
+            if (!(series_x(data_in, i) >= series_x(data_in, i - 1)))
+            {
+                data_in->sorted = 0;
+                break;
+            }
+        }
+    }
+    return data_in->sorted;
+}
+
+// First index in [begin, end) whose x is not below value (x sorted)
+int lower_bound_x(const plot_data *data_in, int begin, int end, double value)
+{
+    while (begin < end)
+    {
+        int mid = begin + (end - begin) / 2;
+        if (series_x(data_in, mid) < value)
+        {
+            begin = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    return begin;
+}
+
+static inline int overlaps(double a0, double a1, double lo, double hi)
+{
+    return (a0 < a1 ? a1 : a0) >= lo && (a0 < a1 ? a0 : a1) <= hi;
+}
+
+// Drops points outside the axis limits.  Lines keep every point whose
+// neighbouring segments may cross the window, so they still reach the
+// edge; stems only need their own x to be visible.
+void clip_points(plt *figure, plot_data *data_in)
+{
+    plt_points *points = &data_in->points;
+    int clip_x = figure->xmin != 0. || figure->xmax != 0.;
+    int clip_y = figure->ymin != 0. || figure->ymax != 0.;
+    int line = strcmp(data_in->type, "plot") == 0;
+
+    // Nothing to clip when every point lies inside the window
+    const double *b = series_bounds(data_in);
+    if (!data_in->has_nan &&
+        (!clip_x || (b[0] >= figure->xmin && b[1] <= figure->xmax)) &&
+        (!clip_y || !line || (b[2] >= figure->ymin && b[3] <= figure->ymax)))
+    {
+        return;
+    }
+
+    if (clip_x && series_sorted(data_in))
+    {
+        int lo = lower_bound_x(data_in, 0, data_in->length, figure->xmin);
+        int hi = lower_bound_x(data_in, lo, data_in->length, figure->xmax);
+        while (hi < data_in->length &&
+               series_x(data_in, hi) <= figure->xmax)
+        {
+            hi++;
+        }
+        if (line)
+        {
+            lo = lo > 0 ? lo - 1 : lo;
+            hi = hi < data_in->length ? hi + 1 : hi;
+        }
+        points->begin = lo;
+        points->end = hi;
+        points->count = hi - lo;
+        clip_x = 0;
+    }
+
+    if (!clip_x && (!clip_y || !line))
+    {
+        return;
+    }
+
+    double xmin = clip_x ? figure->xmin : -INFINITY;
+    double xmax = clip_x ? figure->xmax : INFINITY;
+    double ymin = clip_y && line ? figure->ymin : -INFINITY;
+    double ymax = clip_y && line ? figure->ymax : INFINITY;
+
+    points->index = (int *)PLT_MALLOC(sizeof(int) * (size_t)points->count);
+    int count = 0;
+    for (int i = points->begin; i < points->end; i++)
+    {
+        double xi = series_x(data_in, i);
+        double yi = series_y(data_in, i);
+        int keep = xi >= xmin && xi <= xmax && yi >= ymin && yi <= ymax;
+        if (!keep && line && i > points->begin)
+        {
+            keep = overlaps(series_x(data_in, i - 1), xi, xmin, xmax) &&
+                   overlaps(series_y(data_in, i - 1), yi, ymin, ymax);
+        }
+        if (!keep && line && i + 1 < points->end)
+        {
+            keep = overlaps(xi, series_x(data_in, i + 1), xmin, xmax) &&
+                   overlaps(yi, series_y(data_in, i + 1), ymin, ymax);
+        }
+        if (keep)
+        {
+            points->index[count++] = i;
+        }
+    }
+    points->count = count;
+}
+
+// 1 if column c (0 for x, 1 for y) of the series holds only integers,
+// scanned when first needed
+int series_integral(plot_data *data_in, int c)
+{
+    if (data_in->integral[c] < 0)
+    {
+        const plt_column *column = c == 0 ? &data_in->x : &data_in->y;
+        data_in->integral[c] =
+            (signed char)column_integral(column, data_in->length);
+    }
+    return data_in->integral[c];
+}
+
+// Resolves data_in->number from its precision policy for the current save
+void series_number(const plt *figure, plot_data *data_in)
+{
+    const char *policy = strcmp(data_in->precision_policy, "") != 0
+                             ? data_in->precision_policy
+                             : figure->precision_policy;
+    plt_number *number = &data_in->number;
+    int fixed = strcmp(policy, "fixed") == 0;
+
+    for (int axis = 0; axis < 2; axis++)
+    {
+        number->precision[axis] = strcmp(policy, "auto") == 0
+                                      ? figure->auto_precision[axis]
+                                      : figure->precision;
+    }
+    number->trim = (unsigned char)!fixed;
+    number->integral[0] =
+        (unsigned char)(!fixed && series_integral(data_in, 0));
+    number->integral[1] =
+        (unsigned char)(!fixed && series_integral(data_in, 1));
+}
+
+int same_number(const plt_number *a, const plt_number *b)
+{
+    return a->precision[0] == b->precision[0] &&
+           a->precision[1] == b->precision[1] && a->trim == b->trim &&
+           a->integral[0] == b->integral[0] &&
+           a->integral[1] == b->integral[1];
+}
+
+// Decimation of a series: its own, or the figure's
+const char *decimate_method(const plt *figure, const plot_data *data_in)
+{
+    return strcmp(data_in->decimate, "") != 0 ? data_in->decimate
+                                              : figure->decimate;
+}
+
+// 1 if the points of a series are simplified against the axis window
+int series_simplified(const plt *figure, const plot_data *data_in)
+{
+    const char *method = decimate_method(figure, data_in);
+    return strcmp(data_in->type, "plot") == 0 &&
+           (strcmp(method, "rdp") == 0 || strcmp(method, "vw") == 0);
+}
+
+// Chooses which points of data_in are written for the current save, and
+// how
+void select_points(plt *figure, plot_data *data_in)
+{
+    plt_points *points = &data_in->points;
+    series_number(figure, data_in);
+    points->begin = 0;
+    points->end = data_in->length;
+    points->index = NULL;
+    points->count = data_in->length;
+
+    clip_points(figure, data_in);
+    if (data_in->raster > 0.)
+    {
+        // Every point in the window lands in the image
+        return;
+    }
+
+    const char *method = decimate_method(figure, data_in);
+    if (strcmp(method, "none") == 0)
+    {
+        return;
+    }
+    int simplify = strcmp(method, "rdp") == 0 || strcmp(method, "vw") == 0;
+    if (strcmp(method, "minmax") != 0 && strcmp(method, "lttb") != 0 &&
+        !simplify)
+    {
+        printf("ERROR: %s invalid decimation method!\n", method);
+        exit(1);
+    }
+
+    int n = points->count;
+    if (n < 3)
+    {
+        return;
+    }
+    if (simplify)
+    {
+        if (strcmp(data_in->type, "plot") != 0)
+        {
+            // Stems have no line to simplify along
+            return;
+        }
+        int *index = (int *)PLT_MALLOC(sizeof(int) * (size_t)n);
+        int count = simplify_points(figure, data_in, points, method, index);
+        PLT_FREE(points->index);
+        points->index = index;
+        points->count = count;
+        return;
+    }
+
+    double x0;
+    double x1;
+    if (n == data_in->length && !data_in->has_nan &&
+        isfinite(data_in->bounds[0]) && isfinite(data_in->bounds[1]))
+    {
+        // Every point is selected: the bounds from clip_points are the range
+        x0 = data_in->bounds[0];
+        x1 = data_in->bounds[1];
+    }
+    else
+    {
+        // Range of the finite x only; the others pass through undecimated
+        x0 = INFINITY;
+        x1 = -INFINITY;
+        for (int k = 0; k < n; k++)
+        {
+            double xk = series_x(data_in, point_at(points, k));
+            if (isfinite(xk))
+            {
+                x0 = xk < x0 ? xk : x0;
+                x1 = xk > x1 ? xk : x1;
+            }
+        }
+    }
+
+    // Pixel columns spanned by the series on the rendered axis
+    double width = figure->width != 0. ? figure->width : PLT_DEFAULT_WIDTH;
+    double pixels = width / 2.54 * figure->dpi;
+    if (figure->xmin != 0. || figure->xmax != 0.)
+    {
+        pixels *= (x1 - x0) / (figure->xmax - figure->xmin);
+    }
+    int buckets = pixels < 1. ? 1 : (int)pixels;
+
+    int *index;
+    int count;
+    if (strcmp(method, "minmax") == 0)
+    {
+        if (n <= 4 * buckets)
+        {
+            return;
+        }
+        index = (int *)PLT_MALLOC(sizeof(int) * (size_t)n);
+        count = decimate_minmax(data_in, points, x0, x1, buckets, index);
+    }
+    else
+    {
+        int threshold = 2 * buckets < 3 ? 3 : 2 * buckets;
+        if (n <= threshold)
+        {
+            return;
+        }
+        index = (int *)PLT_MALLOC(sizeof(int) * (size_t)threshold);
+        count = decimate_lttb(data_in, points, threshold, index);
+    }
+
+    PLT_FREE(points->index);
+    points->index = index;
+    points->count = count;
+}
+
+void release_points(plot_data *data_in)
+{
+    PLT_FREE(data_in->points.index);
+    data_in->points.index = NULL;
+}
+
+// Formats one "(x,y)" line straight into the sink buffer
+void write_point(plt_sink *sink, const plot_data *data_in, int i,
+                 const plt_number *number)
+{
+    char *start = sink_reserve(sink, 2 * PLT_FMT_MAX + 8);
+    char *p = start;
+
+    memcpy(p, "    (", 5);
+    p += 5;
+    p = put_number(p, series_x(data_in, i), number, 0);
+    *p++ = ',';
+    p = put_number(p, series_y(data_in, i), number, 1);
+    *p++ = ')';
+    *p++ = '\n';
+    sink->len += (size_t)(p - start);
+}
+
+// Writes the selected points [k0, k1) of a series in its number format
+void write_coordinates(plt_sink *sink, plot_data *data_in, int k0, int k1)
+{
+    const plt_points *points = &data_in->points;
+    const plt_number *number = &data_in->number;
+
+#ifdef PLT_BLOCK_FORMAT
+    for (; k0 + PLT_BLOCK <= k1; k0 += PLT_BLOCK)
+    {
+        double v[2 * PLT_BLOCK];
+        for (int j = 0; j < PLT_BLOCK; j++)
+        {
+            int i = point_at(points, k0 + j);
+            v[2 * j] = series_x(data_in, i);
+            v[2 * j + 1] = series_y(data_in, i);
+        }
+
+        char *start =
+            sink_reserve(sink, PLT_BLOCK * (2 * PLT_FMT_MAX + 8));
+        sink->len += fmt_block(start, v, number);
+    }
+#endif
+
+    if (points->index != NULL)
+    {
+        for (int k = k0; k < k1; ++k)
+        {
+            write_point(sink, data_in, points->index[k], number);
+        }
+    }
+    else
+    {
+        for (int i = points->begin + k0; i < points->begin + k1; ++i)
+        {
+            write_point(sink, data_in, i, number);
+        }
+    }
+}
+
+void plot_options(plt_sink *sink, const char *color)
+{
+
+    sink_puts(sink, "\\addplot [\n");
+
+    if (strcmp(color, "") != 0)
+    {
+        sink_printf(sink, "color=%s,\n", color);
+    }
+
+    /* "mark=%s, " */
+    /* "mark options={scale=1.5}, " */
+    sink_puts(sink, "line width=1pt]");
+}
+
+void stem_options(plt_sink *sink, const char *color)
+{
+    sink_printf(sink, "\\addplot +[ycomb, %s, thick, mark options={fill}]",
+                color);
+}
+
+// Writes the "\addplot [...]" part of a series, up to its data
+void series_options(plt_sink *sink, plot_data *data_in)
+{
+    if (strcmp(data_in->type, "plot") == 0)
+    {
+        plot_options(sink, data_in->color);
+    }
+    else if (strcmp(data_in->type, "stem") == 0)
+    {
+        stem_options(sink, data_in->color);
+    }
+    else
+    {
+        printf("ERROR:  %s invalid plot type!\n", data_in->type);
+        exit(1);
+    }
+}
+
+void plot_head(plt_sink *sink, const char *color)
+{
+    plot_options(sink, color);
+    sink_puts(sink, " coordinates {\n");
+}
+
+void series_head(plt_sink *sink, plot_data *data_in)
+{
+    series_options(sink, data_in);
+    sink_puts(sink, " coordinates {\n");
+}
+
+void series_legend(plt_sink *sink, const char *legend)
+{
+    if (strcmp(legend, "") != 0)
+    {
+        sink_printf(sink, "\\addlegendentry{%s}\n", legend);
+    }
+}
+
+void series_tail(plt_sink *sink, const char *legend)
+{
+    sink_puts(sink, "};\n");
+    series_legend(sink, legend);
+}
+
+// Brings data_in->cache up to date, formatting only what changed
+void update_cache(plt *figure, plot_data *data_in)
+{
+    series_number(figure, data_in);
+    // Unset limits follow every series, so a simplified series is also
+    // stale once another one moves the window
+    int valid = data_in->cache.buf != NULL &&
+                data_in->cached_generation == figure->generation &&
+                same_number(&data_in->number, &data_in->cached_number) &&
+                (!series_simplified(figure, data_in) ||
+                 memcmp(data_in->cached_window, figure->window,
+                        sizeof(figure->window)) == 0);
+
+    if ((valid && data_in->dirty == 0) || data_in->raster > 0.)
+    {
+        return;
+    }
+
+    select_points(figure, data_in);
+
+    const plt_points *points = &data_in->points;
+    int every = points->index == NULL && points->begin == 0;
+    if (data_in->cache.buf == NULL)
+    {
+        sink_init_memory(&data_in->cache);
+    }
+    if (!(valid && data_in->dirty == 1 && every &&
+          data_in->cached_points >= 0))
+    {
+        data_in->cache.len = 0;
+        data_in->cached_points = 0;
+    }
+    write_coordinates(&data_in->cache, data_in, data_in->cached_points,
+                      points->count);
+
+    data_in->cached_points = every ? points->count : -1;
+    data_in->cached_generation = figure->generation;
+    memcpy(data_in->cached_window, figure->window, sizeof(figure->window));
+    data_in->cached_number = data_in->number;
+    data_in->dirty = 0;
+    release_points(data_in);
+}
+
+/*
+ * Runs fn(ctx, task) for every task in [0, n_tasks) on up to threads
+ * threads, the caller included.  Tasks are handed out in order.
+ */
+typedef struct plt_pool
+{
+    pthread_mutex_t lock;
+    int next;
+    int n_tasks;
+    void (*fn)(void *ctx, int task);
+    void *ctx;
+} plt_pool;
+
+void *pool_worker(void *arg)
+{
+    plt_pool *pool = (plt_pool *)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        int task = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (task >= pool->n_tasks)
+        {
+            return NULL;
+        }
+        pool->fn(pool->ctx, task);
+    }
+}
+
+void parallel_for(int n_tasks, void (*fn)(void *ctx, int task), void *ctx,
+                  int threads)
+{
+    plt_pool pool;
+    pthread_t workers[PLT_MAX_THREADS];
+
+    if (threads > n_tasks)
+    {
+        threads = n_tasks;
+    }
+    if (threads <= 1)
+    {
+        for (int task = 0; task < n_tasks; task++)
+        {
+            fn(ctx, task);
+        }
+        return;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.next = 0;
+    pool.n_tasks = n_tasks;
+    pool.fn = fn;
+    pool.ctx = ctx;
+
+    for (int t = 1; t < threads; t++)
+    {
+        pthread_create(&workers[t], NULL, pool_worker, &pool);
+    }
+    pool_worker(&pool);
+    for (int t = 1; t < threads; t++)
+    {
+        pthread_join(workers[t], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+}
+
+// A run of selected points of one series, formatted on its own
+typedef struct plt_chunk
+{
+    plot_data *series;
+    int k0;
+    int k1;
+    plt_sink text;
+} plt_chunk;
+
+typedef struct plt_format_job
+{
+    plt *figure;
+    int first;
+    plt_chunk *chunks;
+} plt_format_job;
+
+void cache_task(void *ctx, int task)
+{
+    plt_format_job *job = (plt_format_job *)ctx;
+    update_cache(job->figure, job->figure->series[job->first + task]);
+}
+
+void select_task(void *ctx, int task)
+{
+    plt_format_job *job = (plt_format_job *)ctx;
+    select_points(job->figure, job->figure->series[job->first + task]);
+}
+
+void format_task(void *ctx, int task)
+{
+    plt_format_job *job = (plt_format_job *)ctx;
+    plt_chunk *chunk = &job->chunks[task];
+
+    sink_init(&chunk->text, (size_t)(chunk->k1 - chunk->k0) * 24);
+    write_coordinates(&chunk->text, chunk->series, chunk->k0, chunk->k1);
+}
+
+/*
+ * Parallel write_series: series are selected concurrently, then split into
+ * chunks of PLT_PARALLEL_CHUNK points that are formatted in waves of a few
+ * chunks per thread and appended to the sink in list order.
+ */
+void write_series_parallel(plt_sink *sink, plt *figure, int first)
+{
+    plt_format_job job;
+    int wave = 4 * figure->threads;
+    int n_chunks = 0;
+
+    job.figure = figure;
+    job.first = first;
+    job.chunks = (plt_chunk *)PLT_MALLOC(sizeof(plt_chunk) * (size_t)wave);
+
+    PLT_STAT(plt_stage stage = stage_begin();)
+    parallel_for(figure->n_series - first, select_task, &job,
+                 figure->threads);
+    PLT_STAT(stats_current()->select_seconds += stage_seconds(stage);)
+
+    for (int i = first; i < figure->n_series; i++)
+    {
+        plot_data *current = figure->series[i];
+        int k = 0;
+
+        do
+        {
+            plt_chunk *chunk = &job.chunks[n_chunks++];
+            chunk->series = current;
+            chunk->k0 = k;
+            k = current->points.count - k > PLT_PARALLEL_CHUNK
+                    ? k + PLT_PARALLEL_CHUNK
+                    : current->points.count;
+            chunk->k1 = k;
+
+            int last = i == figure->n_series - 1 && k == current->points.count;
+            if (n_chunks < wave && !last)
+            {
+                continue;
+            }
+
+            parallel_for(n_chunks, format_task, &job, figure->threads);
+            for (int c = 0; c < n_chunks; c++)
+            {
+                plot_data *owner = job.chunks[c].series;
+                if (job.chunks[c].k0 == 0)
+                {
+                    series_head(sink, owner);
+                }
+                sink_write(sink, job.chunks[c].text.buf,
+                           job.chunks[c].text.len);
+                PLT_FREE(job.chunks[c].text.buf);
+                if (job.chunks[c].k1 == owner->points.count)
+                {
+                    series_tail(sink, owner->legend);
+                }
+            }
+            n_chunks = 0;
+        } while (k < current->points.count);
+    }
+
+    for (int i = first; i < figure->n_series; i++)
+    {
+        release_points(figure->series[i]);
+    }
+    PLT_FREE(job.chunks);
+}
+
+void clean_up(plt *figure)
+{
+    for (int i = 0; i < figure->n_series; i++)
+    {
+        plt_free(figure, figure->series[i]->store);
+        PLT_FREE(figure->series[i]->cache.buf);
+        if (figure->series[i]->mapping != NULL)
+        {
+            munmap(figure->series[i]->mapping, figure->series[i]->mapping_len);
+        }
+        plt_free(figure, figure->series[i]);
+    }
+    plt_free(figure, figure->series);
+
+    while (figure->xaxis != NULL)
+    {
+        plt_axis *next = figure->xaxis->next;
+        plt_free(figure, figure->xaxis);
+        figure->xaxis = next;
+    }
+    PLT_FREE(figure->header);
+    if (figure->mapping != NULL)
+    {
+        munmap(figure->mapping, figure->mapping_len);
+    }
+    for (int i = 0; i < figure->n_panels; i++)
+    {
+        clean_up(figure->panels[i]);
+    }
+    plt_free(figure, figure->panels);
+
+    plt_free(figure, figure);
+    figure = NULL;
+}
+
+// Frees a figure that was saved with a _keep variant, or never saved
+void plt_close(plt *figure)
+{
+    clean_up(figure);
+}
+
+// Step of about a fifth of range rounded to 1, 2 or 5 times a power of 10
+double nice_step(double range)
+{
+    double step = pow(10., floor(log10(range / 5.)));
+    double f = range / 5. / step;
+
+    return (f <= 1. ? 1. : f <= 2. ? 2. : f <= 5. ? 5. : 10.) * step;
+}
+
+// Widens [*lo, *hi] to multiples of nice_step for mode "nice".  Returns 0
+// when the range is empty or not finite.
+int pad_limits(const char *mode, double *lo, double *hi)
+{
+    if (!isfinite(*lo) || !isfinite(*hi) || !(*lo < *hi))
+    {
+        return 0;
+    }
+    if (strcmp(mode, "nice") == 0)
+    {
+        double step = nice_step(*hi - *lo);
+        *lo = floor(*lo / step) * step;
+        *hi = ceil(*hi / step) * step;
+    }
+    return 1;
+}
+
+void write_axis_limits(plt_sink *sink, char axis, double lo, double hi)
+{
+    char text[2][32];
+    double limit[2] = {lo, hi};
+    for (int k = 0; k < 2; k++)
+    {
+        // Shortest of 15 or 17 digits that reads back as the same value
+        snprintf(text[k], sizeof(text[k]), "%.15g", limit[k]);
+        if (strtod(text[k], NULL) != limit[k])
+        {
+            snprintf(text[k], sizeof(text[k]), "%.17g", limit[k]);
+        }
+    }
+    sink_printf(sink, "%cmin = %s, %cmax = %s,\n", axis, text[0], axis,
+                text[1]);
+}
+
+// Explicit limits for the axes the user left unset, so that pgfplots does
+// not have to scan the coordinates for them
+void write_data_limits(plt_sink *sink, plt *figure)
+{
+    double b[4];
+
+    data_bounds(figure, b);
+    if (figure->xmin == 0. && figure->xmax == 0. &&
+        pad_limits(figure->autoscale, &b[0], &b[1]))
+    {
+        write_axis_limits(sink, 'x', b[0], b[1]);
+    }
+    if (figure->ymin == 0. && figure->ymax == 0. &&
+        pad_limits(figure->autoscale, &b[2], &b[3]))
+    {
+        write_axis_limits(sink, 'y', b[2], b[3]);
+    }
+}
+
+void write_axis_options(plt_sink *sink, plt *figure)
+{
+    sink_puts(sink, "[\n");
+
+    // Fix label locations for "center" case
+    if (strcmp(figure->type, "center") == 0)
+    {
+        sink_puts(sink, "axis lines=center,\n"
+                        "axis x line = middle,\n"
+                        "every axis x label/.style={\n"
+                        "at={(ticklabel* cs:1.0)},\n"
+                        "anchor=west,\n"
+                        "},\n"
+                        "axis y line = left,\n"
+                        "every axis y label/.style={\n"
+                        "at={(ticklabel* cs:1.0)},\n"
+                        "anchor=south,\n"
+                        "},");
+    }
+    else if (strcmp(figure->type, "standard") == 0)
+    {
+    }
+    else
+    {
+        printf("ERROR: please set axis type  'standard' or "
+               "'center'\n");
+        exit(1);
+    }
+
+    if ((figure->xmin != 0.) || (figure->xmax != 0.))
+    {
+        sink_printf(sink, "xmin = %f, xmax = %f,\n", figure->xmin,
+                    figure->xmax);
+    }
+
+    if ((figure->ymin != 0.) || (figure->ymax != 0.))
+    {
+        sink_printf(sink, "ymin = %f, ymax = %f,\n", figure->ymin,
+                    figure->ymax);
+    }
+
+    if (strcmp(figure->autoscale, "none") != 0)
+    {
+        write_data_limits(sink, figure);
+    }
+
+    if (figure->grid == 1)
+    {
+        sink_puts(sink, "grid=major,\n");
+    }
+
+    if (figure->width != 0.)
+    {
+        sink_printf(sink, "width=%f cm,\n", figure->width);
+    }
+
+    if (figure->height != 0.)
+    {
+        sink_printf(sink, "height=%f cm,\n", figure->height);
+    }
+
+    if (strcmp(figure->xlabel, "") != 0)
+    {
+        sink_printf(sink, "xlabel=%s,\n", figure->xlabel);
+    }
+
+    if (strcmp(figure->ylabel, "") != 0)
+    {
+        sink_printf(sink, "ylabel=%s,\n", figure->ylabel);
+    }
+
+    if (strcmp(figure->legend_position, "") != 0)
+    {
+        sink_printf(sink, "legend pos=%s,\n", figure->legend_position);
+    }
+
+    sink_puts(sink, "]\n");
+}
+
+int open_output(const char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        printf("ERROR: cannot open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+int compressed(const plt *figure)
+{
+    size_t n = strlen(figure->filename);
+
+    if (strcmp(figure->compress, "auto") == 0)
+    {
+        return n >= 3 && strcmp(figure->filename + n - 3, ".gz") == 0;
+    }
+    return strcmp(figure->compress, "gzip") == 0;
+}
+
+// Opens path (the figure or one of its tables) for writing, through gzip
+// when the figure is compressed
+void sink_open(plt_sink *sink, const plt *figure, const char *path)
+{
+    if (!compressed(figure))
+    {
+        sink_init_fd(sink, open_output(path), figure->buffer_size);
+        return;
+    }
+#ifdef PLT_USE_ZLIB
+    size_t n = strlen(path);
+    char *gz_path = (char *)PLT_MALLOC(n + 4);
+
+    strcpy(gz_path, path);
+    if (n < 3 || strcmp(path + n - 3, ".gz") != 0)
+    {
+        strcat(gz_path, ".gz");
+    }
+    sink_init_gzip(sink, open_output(gz_path), figure->buffer_size);
+    PLT_FREE(gz_path);
+#else
+    printf("ERROR: gzip output of %s needs PLT_USE_ZLIB and -lz\n", path);
+    exit(1);
+#endif
+}
+
+// Flushes and closes a sink from sink_open
+void sink_close_output(plt_sink *sink)
+{
+#ifdef PLT_USE_ZLIB
+    if (sink->flush == sink_flush_gzip)
+    {
+        sink_finish_gzip(sink);
+        return;
+    }
+#endif
+    int fd = sink->fd;
+    sink_close(sink);
+    close(fd);
+}
+
+// Side file k of the figure, a table or an image: its filename with the
+// extension replaced by "_<k>.<ext>" (a ".gz" suffix is dropped first)
+void side_path(const plt *figure, int k, const char *ext, char *path,
+               size_t size)
+{
+    char name[sizeof(figure->filename)];
+    size_t n = strlen(figure->filename);
+
+    strcpy(name, figure->filename);
+    if (n >= 3 && strcmp(name + n - 3, ".gz") == 0)
+    {
+        name[n - 3] = '\0';
+    }
+
+    const char *slash = strrchr(name, '/');
+    const char *dot = strrchr(slash != NULL ? slash : name, '.');
+    int stem = dot != NULL ? (int)(dot - name) : (int)strlen(name);
+
+    snprintf(path, size, "%.*s_%d.%s", stem, name, k, ext);
+}
+
+/*
+ * Raster series.  A rasterized series is binned into a pixel grid at the
+ * figure's dpi instead of being written point by point: each point covers
+ * its pixel with the series' opacity a, so a pixel hit n times is drawn
+ * with opacity 1 - (1 - a)^n.  The grid spans the points inside the
+ * window and is written as an RGBA PNG next to the figure, which the
+ * picture places over the same extent.  The rest of the figure stays
+ * vector, and its size no longer grows with the points of the series.
+ */
+#define PLT_RASTER_MAX 8192
+// Longest run of a stored deflate block
+#define PLT_STORED_BLOCK 65535
+
+typedef struct plt_named_color
+{
+    const char *name;
+    unsigned char rgb[3];
+} plt_named_color;
+
+// xcolor's base colours
+static const plt_named_color plt_colors[] = {
+    {"black", {0, 0, 0}},         {"blue", {0, 0, 255}},
+    {"brown", {191, 128, 64}},    {"cyan", {0, 255, 255}},
+    {"darkgray", {64, 64, 64}},   {"gray", {128, 128, 128}},
+    {"green", {0, 255, 0}},       {"lightgray", {191, 191, 191}},
+    {"lime", {191, 255, 0}},      {"magenta", {255, 0, 255}},
+    {"olive", {128, 128, 0}},     {"orange", {255, 128, 0}},
+    {"pink", {255, 191, 191}},    {"purple", {191, 0, 64}},
+    {"red", {255, 0, 0}},         {"teal", {0, 128, 128}},
+    {"violet", {128, 0, 128}},    {"white", {255, 255, 255}},
+    {"yellow", {255, 255, 0}},
+};
+
+// RGB of a base colour name with an optional "!<percent>" tint towards
+// white; "" is blue, the first colour of pgfplots' cycle list
+void raster_color(const char *color, unsigned char rgb[3])
+{
+    const char *bang = strchr(color, '!');
+    size_t n = bang != NULL ? (size_t)(bang - color) : strlen(color);
+    double tint = bang != NULL ? atof(bang + 1) / 100. : 1.;
+    const char *name = n > 0 ? color : "blue";
+
+    n = n > 0 ? n : 4;
+    for (size_t c = 0; c < sizeof(plt_colors) / sizeof(plt_colors[0]); c++)
+    {
+        if (strlen(plt_colors[c].name) != n ||
+            strncmp(plt_colors[c].name, name, n) != 0 || !(tint >= 0.) ||
+            tint > 1.)
+        {
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            rgb[k] = (unsigned char)lround(plt_colors[c].rgb[k] * tint +
+                                           255. * (1. - tint));
+        }
+        return;
+    }
+    printf("ERROR: %s cannot be rasterized, use a base colour!\n", color);
+    exit(1);
+}
+
+static inline void put_be32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+// CRC-32 of PNG chunks, continuing from crc (0 to start), a nibble at a
+// time
+uint32_t png_crc(uint32_t crc, const unsigned char *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = table[crc & 15] ^ (crc >> 4);
+        crc = table[crc & 15] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+// Adler-32 that ends a zlib stream
+uint32_t png_adler(const unsigned char *data, size_t len)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    while (len > 0)
+    {
+        // The sums cannot overflow within 5552 bytes
+        size_t n = len < 5552 ? len : 5552;
+        for (size_t i = 0; i < n; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        len -= n;
+    }
+    return b << 16 | a;
+}
+
+// The zlib stream of raw: deflated with PLT_USE_ZLIB, else in stored
+// blocks
+unsigned char *png_zlib(const unsigned char *raw, size_t len,
+                        size_t *out_len)
+{
+#ifdef PLT_USE_ZLIB
+    uLongf n = compressBound((uLong)len);
+    unsigned char *out = (unsigned char *)PLT_MALLOC(n);
+    if (compress2(out, &n, raw, (uLong)len, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        printf("ERROR: cannot compress raster image\n");
+        exit(1);
+    }
+    *out_len = n;
+    return out;
+#else
+    size_t blocks = len / PLT_STORED_BLOCK + 1;
+    unsigned char *out = (unsigned char *)PLT_MALLOC(len + 5 * blocks + 6);
+    unsigned char *p = out;
+    size_t done = 0;
+
+    *p++ = 0x78;
+    *p++ = 0x01;
+    do
+    {
+        size_t n = len - done < PLT_STORED_BLOCK ? len - done
+                                                 : PLT_STORED_BLOCK;
+        // BFINAL on the last block, BTYPE 00 (stored), then LEN and NLEN
+        *p++ = done + n == len;
+        p[0] = (unsigned char)n;
+        p[1] = (unsigned char)(n >> 8);
+        p[2] = (unsigned char)~n;
+        p[3] = (unsigned char)(~n >> 8);
+        memcpy(p + 4, raw + done, n);
+        p += 4 + n;
+        done += n;
+    } while (done < len);
+    put_be32(p, png_adler(raw, len));
+    *out_len = (size_t)(p + 4 - out);
+    return out;
+#endif
+}
+
+void png_chunk(plt_sink *sink, const char *type, const unsigned char *data,
+               size_t len)
+{
+    unsigned char word[8];
+
+    put_be32(word, (uint32_t)len);
+    memcpy(word + 4, type, 4);
+    sink_write(sink, (const char *)word, 8);
+    sink_write(sink, (const char *)data, len);
+    put_be32(word, png_crc(png_crc(0, word + 4, 4), data, len));
+    sink_write(sink, (const char *)word, 4);
+}
+
+// Writes an 8-bit RGBA PNG from raw, rows of a filter byte and 4 * width
+// bytes
+void write_png(const char *path, int width, int height,
+               const unsigned char *raw)
+{
+    unsigned char ihdr[13] = {0};
+    size_t len;
+    unsigned char *idat =
+        png_zlib(raw, (size_t)height * (4 * (size_t)width + 1), &len);
+    plt_sink sink;
+
+    put_be32(ihdr, (uint32_t)width);
+    put_be32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 8;
+    ihdr[9] = 6;
+
+    sink_init_fd(&sink, open_output(path), PLT_SINK_CHUNK);
+    sink_write(&sink, "\x89PNG\r\n\x1a\n", 8);
+    png_chunk(&sink, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(&sink, "IDAT", idat, len);
+    png_chunk(&sink, "IEND", ihdr, 0);
+    int fd = sink.fd;
+    sink_close(&sink);
+    close(fd);
+    PLT_FREE(idat);
+}
+
+// Extent {x0, x1, y0, y1} of the points of data_in inside the window,
+// widened when empty.  Returns 0 when no point is finite.
+int raster_extent(plt *figure, plot_data *data_in, double e[4])
+{
+    const double *b = series_bounds(data_in);
+    double window[4] = {figure->xmin, figure->xmax, figure->ymin,
+                        figure->ymax};
+
+    memcpy(e, b, sizeof(double) * 4);
+    for (int axis = 0; axis < 4; axis += 2)
+    {
+        if (window[axis] != 0. || window[axis + 1] != 0.)
+        {
+            e[axis] = e[axis] > window[axis] ? e[axis] : window[axis];
+            e[axis + 1] =
+                e[axis + 1] < window[axis + 1] ? e[axis + 1] : window[axis + 1];
+        }
+        if (!isfinite(e[axis]) || !isfinite(e[axis + 1]) ||
+            e[axis] > e[axis + 1])
+        {
+            return 0;
+        }
+        if (e[axis] == e[axis + 1])
+        {
+            e[axis] -= 0.5;
+            e[axis + 1] += 0.5;
+        }
+    }
+    return 1;
+}
+
+// Pixels across [lo, hi] of an axis that spans [axis_lo, axis_hi] over
+// size cm
+int raster_pixels(const plt *figure, double size, double lo, double hi,
+                  double axis_lo, double axis_hi)
+{
+    double pixels = size / 2.54 * figure->dpi;
+
+    if (isfinite(axis_hi - axis_lo) && axis_hi > axis_lo)
+    {
+        pixels *= (hi - lo) / (axis_hi - axis_lo);
+    }
+    return pixels < 1.               ? 1
+           : pixels > PLT_RASTER_MAX ? PLT_RASTER_MAX
+                                     : (int)ceil(pixels);
+}
+
+/*
+ * Bins the selected points of series k over its extent e into its PNG,
+ * sized for an axis spanning axis[4] over width x height cm, and writes
+ * the PNG's name to path.  Returns 0, writing nothing, when the series
+ * has no finite point.
+ */
+int raster_series(plt *figure, plot_data *data_in, int k,
+                  const double axis[4], double width, double height,
+                  double e[4], char *path, size_t size)
+{
+    if (!raster_extent(figure, data_in, e))
+    {
+        return 0;
+    }
+
+    const plt_points *points = &data_in->points;
+    int w = raster_pixels(figure, width, e[0], e[1], axis[0], axis[1]);
+    int h = raster_pixels(figure, height, e[2], e[3], axis[2], axis[3]);
+    size_t row = 4 * (size_t)w + 1;
+    uint32_t *hits = (uint32_t *)PLT_MALLOC(sizeof(uint32_t) * (size_t)w *
+                                            (size_t)h);
+    double sx = w / (e[1] - e[0]);
+    double sy = h / (e[3] - e[2]);
+
+    memset(hits, 0, sizeof(uint32_t) * (size_t)w * (size_t)h);
+    for (int j = 0; j < points->count; j++)
+    {
+        int i = point_at(points, j);
+        double x = series_x(data_in, i);
+        double y = series_y(data_in, i);
+        if (!(x >= e[0] && x <= e[1] && y >= e[2] && y <= e[3]))
+        {
+            continue;
+        }
+        int col = (int)((x - e[0]) * sx);
+        int line = (int)((e[3] - y) * sy);
+        col = col < w ? col : w - 1;
+        line = line < h ? line : h - 1;
+        hits[(size_t)line * (size_t)w + (size_t)col]++;
+    }
+
+    // Opacity of a pixel by its hits, looked up for the common counts
+    unsigned char opacity[256];
+    double miss = log1p(-data_in->raster);
+    for (int n = 0; n < 256; n++)
+    {
+        opacity[n] = (unsigned char)lround(255. * -expm1(n * miss));
+    }
+
+    unsigned char rgb[3];
+    unsigned char *raw = (unsigned char *)PLT_MALLOC(row * (size_t)h);
+    raster_color(data_in->color, rgb);
+    for (size_t y = 0; y < (size_t)h; y++)
+    {
+        unsigned char *p = raw + y * row;
+        const uint32_t *n = hits + y * (size_t)w;
+
+        *p++ = 0;
+        for (size_t x = 0; x < (size_t)w; x++)
+        {
+            memcpy(p, rgb, 3);
+            p[3] = n[x] < 256 ? opacity[n[x]]
+                              : (unsigned char)lround(
+                                    255. * -expm1((double)n[x] * miss));
+            p += 4;
+        }
+    }
+
+    side_path(figure, k, "png", path, size);
+    write_png(path, w, h, raw);
+    PLT_FREE(raw);
+    PLT_FREE(hits);
+    return 1;
+}
+
+// Series k as "\addplot graphics" when it is rasterized; its points must
+// have been selected
+void write_raster(plt_sink *sink, plt *figure, plot_data *data_in, int k)
+{
+    double axis[4];
+    double e[4];
+    char path[sizeof(figure->filename) + 16];
+    const char *color = data_in->color;
+    const char *separator = strcmp(color, "") != 0 ? ", color=" : "";
+
+    axis_window(figure, axis);
+
+    double width = figure->width != 0. ? figure->width : PLT_DEFAULT_WIDTH;
+    double height =
+        figure->height != 0. ? figure->height : PLT_DEFAULT_HEIGHT;
+    if (raster_series(figure, data_in, k, axis, width, height, e, path,
+                      sizeof(path)))
+    {
+        // Marks are the legend image of the dots the picture shows
+        sink_printf(sink,
+                    "\\addplot [only marks, mark=*%s%s] graphics "
+                    "[xmin=%.17g, xmax=%.17g, ymin=%.17g, ymax=%.17g] "
+                    "{%s};\n",
+                    separator, color, e[0], e[1], e[2], e[3], path);
+    }
+    else if (strcmp(data_in->legend, "") != 0)
+    {
+        sink_printf(sink, "\\addlegendimage{only marks, mark=*%s%s}\n",
+                    separator, color);
+    }
+    series_legend(sink, data_in->legend);
+}
+
+int same_column(const plt_column *a, const plt_column *b)
+{
+    return a->ptr == b->ptr && a->stride == b->stride &&
+           a->dtype == b->dtype && a->start == b->start && a->step == b->step;
+}
+
+int same_points(const plt_points *a, const plt_points *b)
+{
+    if (a->count != b->count || (a->index == NULL) != (b->index == NULL))
+    {
+        return 0;
+    }
+    if (a->index == NULL)
+    {
+        return a->begin == b->begin;
+    }
+    return memcmp(a->index, b->index, sizeof(int) * (size_t)a->count) == 0;
+}
+
+// A uniform x over a contiguous selection can be left to pgfplots
+int implicit_x(const plot_data *data_in)
+{
+    return data_in->x.dtype == PLT_UNIFORM && data_in->points.index == NULL;
+}
+
+// Writes "x y1 y2 ..." rows for series that share x and their selection;
+// the x column is left out when implicit_x holds.
+void write_table(plt *figure, plot_data **columns, int n, const char *path)
+{
+    int with_x = !implicit_x(columns[0]);
+    const plt_points *points = &columns[0]->points;
+    plt_sink sink;
+
+    sink_open(&sink, figure, path);
+    for (int k = 0; k < points->count; k++)
+    {
+        int i = point_at(points, k);
+        size_t room = (size_t)(n + 1) * (PLT_FMT_MAX + 1);
+        char *start = sink_reserve(&sink, room);
+        char *p = start;
+
+        if (with_x)
+        {
+            p = put_number(p, series_x(columns[0], i), &columns[0]->number,
+                           0);
+        }
+        for (int c = 0; c < n; c++)
+        {
+            if (with_x || c > 0)
+            {
+                *p++ = ' ';
+            }
+            p = put_number(p, series_y(columns[c], i), &columns[c]->number,
+                           1);
+        }
+        *p++ = '\n';
+        sink.len += (size_t)(p - start);
+    }
+    sink_close_output(&sink);
+}
+
+/*
+ * Table mode: the points go to side files next to figure->filename and the
+ * picture reads them with "\addplot table".  Series drawn over the same x
+ * array with the same selected points share one multi-column table, and
+ * uniform x is computed by pgfplots with "x expr" instead of stored.
+ */
+void write_series_tables(plt_sink *sink, plt *figure, int first)
+{
+    int n = figure->n_series - first;
+    plot_data **series = figure->series + first;
+    int *table = (int *)PLT_MALLOC(sizeof(int) * (size_t)n);
+    int *column = (int *)PLT_MALLOC(sizeof(int) * (size_t)n);
+    plot_data **members =
+        (plot_data **)PLT_MALLOC(sizeof(plot_data *) * (size_t)n);
+    char path[sizeof(figure->filename) + 16];
+    int n_tables = 0;
+
+    PLT_STAT(plt_stage stage = stage_begin();)
+    for (int i = 0; i < n; i++)
+    {
+        select_points(figure, series[i]);
+        table[i] = series[i]->raster > 0. ? -2 : -1;
+    }
+    PLT_STAT(stats_current()->select_seconds += stage_seconds(stage);)
+
+    for (int i = 0; i < n; i++)
+    {
+        if (table[i] != -1)
+        {
+            continue;
+        }
+
+        int n_members = 0;
+        for (int j = i; j < n; j++)
+        {
+            if (table[j] == -1 && same_column(&series[j]->x, &series[i]->x) &&
+                same_points(&series[j]->points, &series[i]->points))
+            {
+                table[j] = figure->n_tables + n_tables;
+                column[j] = ++n_members;
+                members[n_members - 1] = series[j];
+            }
+        }
+
+        side_path(figure, table[i], "dat", path, sizeof(path));
+        write_table(figure, members, n_members, path);
+        n_tables++;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (table[i] == -2)
+        {
+            write_raster(sink, figure, series[i], first + i);
+            release_points(series[i]);
+            continue;
+        }
+        side_path(figure, table[i], "dat", path, sizeof(path));
+        series_options(sink, series[i]);
+        if (implicit_x(series[i]))
+        {
+            const plt_column *x = &series[i]->x;
+            double x0 = x->start + series[i]->points.begin * x->step;
+            sink_printf(sink,
+                        " table [x expr=\\coordindex*%.17g+%.17g, "
+                        "y index=%d] {%s};\n",
+                        x->step, x0, column[i] - 1, path);
+        }
+        else
+        {
+            sink_printf(sink, " table [x index=0, y index=%d] {%s};\n",
+                        column[i], path);
+        }
+        series_legend(sink, series[i]->legend);
+        release_points(series[i]);
+    }
+    figure->n_tables += n_tables;
+
+    PLT_FREE(members);
+    PLT_FREE(column);
+    PLT_FREE(table);
+}
+
+// Renders the picture and axis header into figure->header if it is stale
+void cache_header(plt *figure)
+{
+    if (figure->header != NULL)
+    {
+        return;
+    }
+
+    plt_sink text;
+    sink_init(&text, 1024);
+    sink_puts(&text, "\\begin{tikzpicture}\n");
+    sink_puts(&text, "\\begin{axis}\n");
+    write_axis_options(&text, figure);
+
+    figure->header = text.buf;
+    figure->header_len = text.len;
+}
+
+void write_header(plt_sink *sink, plt *figure)
+{
+    if (strcmp(figure->autoscale, "none") != 0)
+    {
+        // The limits follow the series, so the header is rendered afresh
+        PLT_FREE(figure->header);
+        figure->header = NULL;
+    }
+    cache_header(figure);
+    sink_write(sink, figure->header, figure->header_len);
+}
+
+// Writes the series from index first onwards; their points must have been
+// selected, unless the figure is kept and they are written from the cache
+void write_data(plt_sink *sink, plt *figure, int first)
+{
+    for (int i = first; i < figure->n_series; i++)
+    {
+        plot_data *current = figure->series[i];
+
+        if (current->raster > 0.)
+        {
+            // Kept figures cache no points to select from
+            if (figure->keep)
+            {
+                select_points(figure, current);
+            }
+            write_raster(sink, figure, current, i);
+            if (figure->keep)
+            {
+                release_points(current);
+            }
+            continue;
+        }
+        series_head(sink, current);
+        if (figure->keep)
+        {
+            sink_write(sink, current->cache.buf, current->cache.len);
+        }
+        else
+        {
+            write_coordinates(sink, current, 0, current->points.count);
+        }
+        series_tail(sink, current->legend);
+    }
+}
+
+// 1 if a series from first on is drawn as an image, which the parallel
+// writer leaves to the serial one
+int rasterized(const plt *figure, int first)
+{
+    for (int i = first; i < figure->n_series; i++)
+    {
+        if (figure->series[i]->raster > 0.)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Selects, writes and releases the points of the series from first on
+void format_series(plt_sink *sink, plt *figure, int first)
+{
+    if (strcmp(figure->data_mode, "table") == 0)
+    {
+        if (figure->keep)
+        {
+            printf("ERROR: table data mode cannot be kept across saves\n");
+            exit(1);
+        }
+        write_series_tables(sink, figure, first);
+        return;
+    }
+    if (strcmp(figure->data_mode, "inline") != 0)
+    {
+        printf("ERROR: %s invalid data mode!\n", figure->data_mode);
+        exit(1);
+    }
+    if (figure->keep)
+    {
+        // Only series that changed are formatted, in parallel per series
+        plt_format_job job = {figure, first, NULL};
+        parallel_for(figure->n_series - first, cache_task, &job,
+                     figure->threads);
+        write_data(sink, figure, first);
+        return;
+    }
+    if (figure->threads > 1 && !rasterized(figure, first))
+    {
+        write_series_parallel(sink, figure, first);
+        return;
+    }
+
+    PLT_STAT(plt_stage stage = stage_begin();)
+    for (int i = first; i < figure->n_series; i++)
+    {
+        select_points(figure, figure->series[i]);
+    }
+    PLT_STAT(stats_current()->select_seconds += stage_seconds(stage);)
+
+    write_data(sink, figure, first);
+
+    for (int i = first; i < figure->n_series; i++)
+    {
+        release_points(figure->series[i]);
+    }
+}
+
+#ifdef PLT_STATS
+// Books the time of format_series that was not selection or writing as
+// formatting, and counts the points of the series it wrote
+void stats_series(plt *figure, int first, plt_stage stage, double selecting)
+{
+    plt_stats *stats = stats_current();
+
+    stats->format_seconds +=
+        stage_seconds(stage) - (stats->select_seconds - selecting);
+    for (int i = first; i < figure->n_series; i++)
+    {
+        stats->points_stored += figure->series[i]->length;
+        stats->points_emitted += figure->series[i]->points.count;
+    }
+}
+#endif
+
+#ifdef PLT_STATS
+// Starts the stats of a save of figure; NULL when it has none
+plt_stats *stats_begin(plt *figure)
+{
+    plt_stats *stats = figure->stats;
+    if (stats == NULL)
+    {
+        return NULL;
+    }
+
+    size_t live = __atomic_load_n(&plt_heap_live, __ATOMIC_RELAXED);
+    memset(stats, 0, sizeof(*stats));
+    stats->ingest_seconds = figure->ingest_seconds;
+    stats->total_seconds = plt_clock();
+    stats->allocs = __atomic_load_n(&plt_heap_allocs, __ATOMIC_RELAXED);
+    stats->peak_bytes = live;
+    __atomic_store_n(&plt_heap_peak, live, __ATOMIC_RELAXED);
+    plt_stats_active = stats;
+    return stats;
+}
+
+// Completes stats from stats_begin, after the figure may have been freed
+void stats_end(plt_stats *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+
+    size_t peak = __atomic_load_n(&plt_heap_peak, __ATOMIC_RELAXED);
+    stats->total_seconds = plt_clock() - stats->total_seconds;
+    stats->allocs =
+        __atomic_load_n(&plt_heap_allocs, __ATOMIC_RELAXED) - stats->allocs;
+    stats->peak_bytes = peak > stats->peak_bytes ? peak - stats->peak_bytes
+                                                 : 0;
+    stats->points_dropped = stats->points_stored - stats->points_emitted;
+    plt_stats_active = NULL;
+}
+#endif
+
+// Axis window of the save, and the decimals of the "auto" policy in it:
+// one tenth of a pixel along each axis, or plt_precision for an axis
+// without extent
+void resolve_window(plt *figure)
+{
+    double *w = figure->window;
+    double size[2] = {
+        figure->width != 0. ? figure->width : PLT_DEFAULT_WIDTH,
+        figure->height != 0. ? figure->height : PLT_DEFAULT_HEIGHT};
+
+    axis_window(figure, w);
+    for (int axis = 0; axis < 2; axis++)
+    {
+        double range = w[2 * axis + 1] - w[2 * axis];
+        double step = range / (size[axis] / 2.54 * figure->dpi) / 10.;
+        int need = step > 0. && isfinite(step) ? (int)ceil(-log10(step))
+                                                : figure->precision;
+        need = need < 0 ? 0 : need > PLT_MAX_PRECISION ? PLT_MAX_PRECISION
+                                                       : need;
+        figure->auto_precision[axis] = need;
+    }
+}
+
+// Writes the series from first on, in the figure's data mode
+void write_series(plt_sink *sink, plt *figure, int first)
+{
+    resolve_window(figure);
+    PLT_STAT(double selecting = stats_current()->select_seconds;)
+    PLT_STAT(plt_stage stage = stage_begin();)
+    format_series(sink, figure, first);
+    PLT_STAT(stats_series(figure, first, stage, selecting);)
+}
+
+void write_footer(plt_sink *sink)
+{
+    sink_puts(sink, "\\end{axis}\n");
+    sink_puts(sink, "\\end{tikzpicture}\n");
+}
+
+/*
+ * "tikz" backend.  Points are mapped to canvas centimetres in C and drawn
+ * as plain \draw paths inside a clipped scope, with the frame (or centred
+ * axis lines), ticks, grid, labels and legend drawn around them, so TeX
+ * never parses a data coordinate.  The limits are the user's, else the
+ * data bounds padded to nice steps.  Points landing on the same 0.01 mm as
+ * the one before are dropped, and paths are cut every PLT_TIKZ_PATH points
+ * to stay within TeX's memory.  Data modes and streaming do not apply.
+ */
+#define PLT_TIKZ_PATH 1000
+// Canvas coordinates are clamped to this many cm to keep TeX dimensions
+// in range
+#define PLT_TIKZ_FAR 500.
+// Tick length and the gap left for tick labels, in cm
+#define PLT_TIKZ_TICK 0.1
+#define PLT_TIKZ_LABEL_GAP 0.6
+
+typedef struct plt_canvas
+{
+    double width;
+    double height;
+    double x0;
+    double x1;
+    double y0;
+    double y1;
+} plt_canvas;
+
+static inline double canvas_clamp(double c)
+{
+    return c < -PLT_TIKZ_FAR ? -PLT_TIKZ_FAR : c > PLT_TIKZ_FAR ? PLT_TIKZ_FAR
+                                                                : c;
+}
+
+static inline double canvas_x(const plt_canvas *canvas, double x)
+{
+    return canvas_clamp((x - canvas->x0) / (canvas->x1 - canvas->x0) *
+                        canvas->width);
+}
+
+static inline double canvas_y(const plt_canvas *canvas, double y)
+{
+    return canvas_clamp((y - canvas->y0) / (canvas->y1 - canvas->y0) *
+                        canvas->height);
+}
+
+// Limits of one axis: the user's, else the padded data bounds, else a
+// unit range around them
+void canvas_limits(const plt *figure, double user_lo, double user_hi,
+                   double lo, double hi, double *out)
+{
+    const char *mode =
+        strcmp(figure->autoscale, "tight") == 0 ? "tight" : "nice";
+
+    if (user_lo != 0. || user_hi != 0.)
+    {
+        lo = user_lo;
+        hi = user_hi;
+    }
+    else if (!pad_limits(mode, &lo, &hi))
+    {
+        double mid = isfinite(lo) ? lo : 0.;
+        lo = mid - 1.;
+        hi = mid + 1.;
+    }
+    out[0] = lo;
+    out[1] = hi;
+}
+
+// Writes "(cx,cy)" in units of 0.01 mm and returns its length
+static inline int canvas_point(char *buf, long qx, long qy)
+{
+    char *p = buf;
+
+    *p++ = '(';
+    p += fmt_fixed(p, (double)qx / 1000., 3);
+    *p++ = ',';
+    p += fmt_fixed(p, (double)qy / 1000., 3);
+    *p++ = ')';
+    return (int)(p - buf);
+}
+
+// Starts "\draw[color, style]" (or \fill) for a series
+void tikz_command(plt_sink *sink, const char *command, const char *color,
+                  const char *style)
+{
+    int both = strcmp(color, "") != 0 && strcmp(style, "") != 0;
+    sink_printf(sink, "\\%s[%s%s%s]", command, color, both ? ", " : "",
+                style);
+}
+
+// A plot series as connected paths
+void write_tikz_line(plt_sink *sink, const plt_canvas *canvas,
+                     const plot_data *data_in)
+{
+    const plt_points *points = &data_in->points;
+    const char *style = "line width=1pt, line join=round";
+    long last_x = 0;
+    long last_y = 0;
+    int in_path = 0;
+
+    for (int k = 0; k < points->count; k++)
+    {
+        int i = point_at(points, k);
+        double x = series_x(data_in, i);
+        double y = series_y(data_in, i);
+        if (!isfinite(x) || !isfinite(y))
+        {
+            continue;
+        }
+
+        long qx = lround(canvas_x(canvas, x) * 1000.);
+        long qy = lround(canvas_y(canvas, y) * 1000.);
+        if (in_path > 0 && qx == last_x && qy == last_y)
+        {
+            continue;
+        }
+        if (in_path == PLT_TIKZ_PATH)
+        {
+            // The next path starts where this one ends
+            sink_puts(sink, ";\n");
+            tikz_command(sink, "draw", data_in->color, style);
+            sink_puts(sink, "\n");
+            char *p = sink_reserve(sink, 2 * PLT_FMT_MAX + 8);
+            sink->len += (size_t)canvas_point(p, last_x, last_y);
+            in_path = 1;
+        }
+        if (in_path == 0)
+        {
+            tikz_command(sink, "draw", data_in->color, style);
+            sink_puts(sink, "\n");
+        }
+
+        char *start = sink_reserve(sink, 2 * PLT_FMT_MAX + 16);
+        char *p = start;
+        if (in_path > 0)
+        {
+            memcpy(p, " -- ", 4);
+            p += 4;
+        }
+        p += canvas_point(p, qx, qy);
+        *p++ = '\n';
+        sink->len += (size_t)(p - start);
+
+        in_path++;
+        last_x = qx;
+        last_y = qy;
+    }
+    if (in_path > 0)
+    {
+        sink_puts(sink, ";\n");
+    }
+}
+
+// A stem series: lines up from y = 0 (or the nearest edge) and filled
+// marks, as pgfplots' ycomb with mark=* draws them
+void write_tikz_stems(plt_sink *sink, const plt_canvas *canvas,
+                      const plot_data *data_in)
+{
+    const plt_points *points = &data_in->points;
+    double base = canvas_y(canvas, 0.);
+    long qbase = lround((base < 0. ? 0. : base > canvas->height
+                                              ? canvas->height
+                                              : base) *
+                        1000.);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int in_path = 0;
+
+        for (int k = 0; k < points->count; k++)
+        {
+            int i = point_at(points, k);
+            double x = series_x(data_in, i);
+            double y = series_y(data_in, i);
+            if (!isfinite(x) || !isfinite(y))
+            {
+                continue;
+            }
+            if (in_path == 0)
+            {
+                if (pass == 0)
+                {
+                    tikz_command(sink, "draw", data_in->color, "thick");
+                }
+                else
+                {
+                    tikz_command(sink, "fill", data_in->color, "");
+                }
+                sink_puts(sink, "\n");
+            }
+
+            long qx = lround(canvas_x(canvas, x) * 1000.);
+            long qy = lround(canvas_y(canvas, y) * 1000.);
+            char *start = sink_reserve(sink, 4 * PLT_FMT_MAX + 32);
+            char *p = start;
+            if (pass == 0)
+            {
+                p += canvas_point(p, qx, qbase);
+                memcpy(p, " -- ", 4);
+                p += 4;
+                p += canvas_point(p, qx, qy);
+            }
+            else
+            {
+                p += canvas_point(p, qx, qy);
+                memcpy(p, " circle (2pt)", 13);
+                p += 13;
+            }
+            *p++ = '\n';
+            sink->len += (size_t)(p - start);
+
+            if (++in_path == PLT_TIKZ_PATH)
+            {
+                sink_puts(sink, ";\n");
+                in_path = 0;
+            }
+        }
+        if (in_path > 0)
+        {
+            sink_puts(sink, ";\n");
+        }
+    }
+}
+
+// A rasterized series as an image node over the extent of its points
+void write_tikz_raster(plt_sink *sink, plt *figure, const plt_canvas *canvas,
+                       plot_data *data_in, int k)
+{
+    double axis[4] = {canvas->x0, canvas->x1, canvas->y0, canvas->y1};
+    double e[4];
+    char path[sizeof(figure->filename) + 16];
+
+    if (!raster_series(figure, data_in, k, axis, canvas->width,
+                       canvas->height, e, path, sizeof(path)))
+    {
+        return;
+    }
+
+    double x0 = canvas_x(canvas, e[0]);
+    double y0 = canvas_y(canvas, e[2]);
+    sink_printf(sink,
+                "\\node[anchor=south west, inner sep=0] at (%.3f,%.3f) "
+                "{\\includegraphics[width=%.3fcm, height=%.3fcm]{%s}};\n",
+                x0, y0, canvas_x(canvas, e[1]) - x0,
+                canvas_y(canvas, e[3]) - y0, path);
+}
+
+// Tick values of [lo, hi] at nice_step spacing, written to sink through
+// their canvas position c as "\draw" tick marks and "\node" labels
+void write_tikz_ticks(plt_sink *sink, const plt *figure,
+                      const plt_canvas *canvas, char axis, double at)
+{
+    double lo = axis == 'x' ? canvas->x0 : canvas->y0;
+    double hi = axis == 'x' ? canvas->x1 : canvas->y1;
+    double step = nice_step(hi - lo);
+    double extent = axis == 'x' ? canvas->height : canvas->width;
+    int center = strcmp(figure->type, "center") == 0;
+
+    for (double k = ceil(lo / step - 1e-9); k <= floor(hi / step + 1e-9);
+         k++)
+    {
+        double t = fabs(k) < 0.5 ? 0. : k * step;
+        double c = axis == 'x' ? canvas_x(canvas, t) : canvas_y(canvas, t);
+
+        if (figure->grid)
+        {
+            sink_printf(sink,
+                        axis == 'x' ? "\\draw[gray!30, very thin] "
+                                      "(%.3f,0) -- (%.3f,%.3f);\n"
+                                    : "\\draw[gray!30, very thin] "
+                                      "(0,%.3f) -- (%.3f,%.3f);\n",
+                        c, axis == 'x' ? c : extent, axis == 'x' ? extent : c);
+        }
+        if (center)
+        {
+            // Ticks cross the centred axis line
+            sink_printf(sink,
+                        axis == 'x' ? "\\draw (%.3f,%.3f) -- ++(0,%.3f);\n"
+                                    : "\\draw (%.3f,%.3f) -- ++(%.3f,0);\n",
+                        axis == 'x' ? c : at - PLT_TIKZ_TICK / 2,
+                        axis == 'x' ? at - PLT_TIKZ_TICK / 2 : c,
+                        PLT_TIKZ_TICK);
+        }
+        else
+        {
+            // Inward ticks on both sides of the frame
+            sink_printf(sink,
+                        axis == 'x' ? "\\draw (%.3f,0) -- ++(0,%.3f) "
+                                      "(%.3f,%.3f) -- ++(0,%.3f);\n"
+                                    : "\\draw (0,%.3f) -- ++(%.3f,0) "
+                                      "(%.3f,%.3f) -- ++(%.3f,0);\n",
+                        c, PLT_TIKZ_TICK, axis == 'x' ? c : extent,
+                        axis == 'x' ? extent : c, -PLT_TIKZ_TICK);
+        }
+        sink_printf(sink,
+                    axis == 'x' ? "\\node[below] at (%.3f,%.3f) {$%g$};\n"
+                                : "\\node[left] at (%.3f,%.3f) {$%g$};\n",
+                    axis == 'x' ? c : at, axis == 'x' ? at : c, t);
+    }
+}
+
+// Legend box of every series with an entry
+void write_tikz_legend(plt_sink *sink, const plt *figure,
+                       const plt_canvas *canvas)
+{
+    const char *position = figure->legend_position;
+    int west = strstr(position, "west") != NULL;
+    int south = strstr(position, "south") != NULL;
+    int outer = strstr(position, "outer") != NULL;
+    int n = 0;
+
+    for (int i = 0; i < figure->n_series; i++)
+    {
+        n += strcmp(figure->series[i]->legend, "") != 0;
+    }
+    if (n == 0)
+    {
+        return;
+    }
+
+    double x = west ? 0.1 : canvas->width - 0.1;
+    double y = south ? 0.1 : canvas->height - 0.1;
+    if (outer)
+    {
+        // Beside the frame, on the side it names
+        x = west ? -0.1 - PLT_TIKZ_LABEL_GAP : canvas->width + 0.1;
+        west = !west;
+    }
+    sink_printf(sink,
+                "\\matrix[draw, fill=white, inner sep=2pt, row sep=1pt, "
+                "column sep=2pt, anchor=%s %s] at (%.3f,%.3f) {\n",
+                south ? "south" : "north", west ? "west" : "east", x, y);
+
+    for (int i = 0; i < figure->n_series; i++)
+    {
+        const plot_data *series = figure->series[i];
+        if (strcmp(series->legend, "") == 0)
+        {
+            continue;
+        }
+        if (series->raster > 0.)
+        {
+            tikz_command(sink, "fill", series->color, "");
+            sink_puts(sink, " (0.3,0) circle (2pt);");
+        }
+        else if (strcmp(series->type, "stem") == 0)
+        {
+            tikz_command(sink, "draw", series->color, "thick");
+            sink_puts(sink, " (0.3,-0.15) -- (0.3,0.1);\n");
+            tikz_command(sink, "fill", series->color, "");
+            sink_puts(sink, " (0.3,0.1) circle (2pt);");
+        }
+        else
+        {
+            tikz_command(sink, "draw", series->color, "line width=1pt");
+            sink_puts(sink, " (0,0) -- (0.6,0);");
+        }
+        sink_printf(sink, " & \\node[anchor=west] {%s}; \\\\\n",
+                    series->legend);
+    }
+    sink_puts(sink, "};\n");
+}
+
+void write_tikz(plt_sink *sink, plt *figure)
+{
+    plt_canvas canvas;
+    double b[4];
+    double x[2];
+    double y[2];
+
+    resolve_window(figure);
+    data_bounds(figure, b);
+    canvas_limits(figure, figure->xmin, figure->xmax, b[0], b[1], x);
+    canvas_limits(figure, figure->ymin, figure->ymax, b[2], b[3], y);
+    canvas.width = figure->width != 0. ? figure->width : PLT_DEFAULT_WIDTH;
+    canvas.height =
+        figure->height != 0. ? figure->height : PLT_DEFAULT_HEIGHT;
+    canvas.x0 = x[0];
+    canvas.x1 = x[1];
+    canvas.y0 = y[0];
+    canvas.y1 = y[1];
+
+    double w = canvas.width;
+    double h = canvas.height;
+    sink_puts(sink, "\\begin{tikzpicture}\n");
+
+    if (strcmp(figure->type, "center") == 0)
+    {
+        // x axis through y = 0 (or the nearest edge), y axis on the left
+        double zero = canvas_y(&canvas, 0.);
+        zero = zero < 0. ? 0. : zero > h ? h : zero;
+        write_tikz_ticks(sink, figure, &canvas, 'x', zero);
+        write_tikz_ticks(sink, figure, &canvas, 'y', 0.);
+        sink_printf(sink, "\\draw[->] (0,%.3f) -- (%.3f,%.3f);\n", zero, w,
+                    zero);
+        sink_printf(sink, "\\draw[->] (0,0) -- (0,%.3f);\n", h);
+        sink_printf(sink, "\\node[anchor=west] at (%.3f,%.3f) {%s};\n", w,
+                    zero, figure->xlabel);
+        sink_printf(sink, "\\node[anchor=south] at (0,%.3f) {%s};\n", h,
+                    figure->ylabel);
+    }
+    else if (strcmp(figure->type, "standard") == 0)
+    {
+        write_tikz_ticks(sink, figure, &canvas, 'x', 0.);
+        write_tikz_ticks(sink, figure, &canvas, 'y', 0.);
+        sink_printf(sink, "\\draw (0,0) rectangle (%.3f,%.3f);\n", w, h);
+        sink_printf(sink, "\\node[anchor=north] at (%.3f,%.3f) {%s};\n",
+                    w / 2, -PLT_TIKZ_LABEL_GAP, figure->xlabel);
+        sink_printf(sink,
+                    "\\node[anchor=south, rotate=90] at (%.3f,%.3f) {%s};\n",
+                    -PLT_TIKZ_LABEL_GAP - 0.4, h / 2, figure->ylabel);
+    }
+    else
+    {
+        printf("ERROR: please set axis type  'standard' or "
+               "'center'\n");
+        exit(1);
+    }
+
+    sink_printf(sink,
+                "\\begin{scope}\n\\clip (0,0) rectangle (%.3f,%.3f);\n", w,
+                h);
+    PLT_STAT(double selecting = stats_current()->select_seconds;)
+    PLT_STAT(plt_stage stage = stage_begin();)
+    for (int i = 0; i < figure->n_series; i++)
+    {
+        plot_data *series = figure->series[i];
+
+        select_points(figure, series);
+        if (series->raster > 0.)
+        {
+            write_tikz_raster(sink, figure, &canvas, series, i);
+        }
+        else if (strcmp(series->type, "plot") == 0)
+        {
+            write_tikz_line(sink, &canvas, series);
+        }
+        else if (strcmp(series->type, "stem") == 0)
+        {
+            write_tikz_stems(sink, &canvas, series);
+        }
+        else
+        {
+            printf("ERROR:  %s invalid plot type!\n", series->type);
+            exit(1);
+        }
+        release_points(series);
+    }
+    PLT_STAT(stats_series(figure, 0, stage, selecting);)
+    sink_puts(sink, "\\end{scope}\n");
+
+    write_tikz_legend(sink, figure, &canvas);
+    sink_puts(sink, "\\end{tikzpicture}\n");
+}
+
+// A figure with subplots: one groupplot with an axis per panel
+void write_groupplot(plt_sink *sink, plt *figure)
+{
+    if (figure->n_series > 0)
+    {
+        printf("ERROR: a figure with subplots draws series in its panels\n");
+        exit(1);
+    }
+
+    sink_puts(sink, "\\begin{tikzpicture}\n");
+    sink_printf(sink,
+                "\\begin{groupplot}[group style={group size=%d by %d}]\n",
+                figure->panel_cols, figure->n_panels / figure->panel_cols);
+    for (int i = 0; i < figure->n_panels; i++)
+    {
+        plt *panel = figure->panels[i];
+
+        sink_puts(sink, "\\nextgroupplot\n");
+        write_axis_options(sink, panel);
+        panel->n_tables = 0;
+        panel->keep = figure->keep;
+        write_series(sink, panel, 0);
+        panel->keep = 0;
+    }
+    sink_puts(sink, "\\end{groupplot}\n");
+    sink_puts(sink, "\\end{tikzpicture}\n");
+}
+
+// The complete picture of figure in its backend
+void write_figure(plt_sink *sink, plt *figure)
+{
+    if (figure->parent != NULL)
+    {
+        printf("ERROR: subplots are saved with their figure\n");
+        exit(1);
+    }
+    if (figure->n_panels > 0)
+    {
+        if (strcmp(figure->backend, "pgfplots") != 0)
+        {
+            printf("ERROR: subplots need the pgfplots backend\n");
+            exit(1);
+        }
+        write_groupplot(sink, figure);
+        return;
+    }
+    if (strcmp(figure->backend, "tikz") == 0)
+    {
+        write_tikz(sink, figure);
+        return;
+    }
+    // Side tables are numbered afresh, so a save rewrites the same files
+    figure->n_tables = 0;
+    write_header(sink, figure);
+    write_series(sink, figure, 0);
+    write_footer(sink);
+}
+
+// Writes the complete tikzpicture for figure into sink.  The figure is
+// freed unless keep is set, in which case series text is cached in it.
+void save_figure(plt *figure, plt_sink *sink, int keep)
 {
-    char filename[100];
-    char type[10];
-    double xmin;
-    double xmax;
-    double ymin;
-    double ymax;
-    unsigned char grid;
-    double width;
-    double height;
-    char xlabel[100];
-    char ylabel[100];
-    char legend_position[20];
-    plot_data *data;
-} plt;
+    if (figure->stream != NULL)
+    {
+        printf("ERROR: streamed figures are saved with plt_save_fig\n");
+        exit(1);
+    }
 
-plt *plt_figure(char *filename)
-{
-    plt *figure = (plt *)malloc(sizeof(*figure));
-    strcpy(figure->filename, filename);
-    strcpy(figure->type, "standard");
-    strcpy(figure->xlabel, "");
-    strcpy(figure->ylabel, "");
-    strcpy(figure->legend_position, "");
-    figure->xmin = 0.;
-    figure->xmax = 0.;
-    figure->ymin = 0.;
-    figure->ymax = 0.;
-    figure->data = NULL;
+    figure->keep = keep;
+    write_figure(sink, figure);
+    figure->keep = 0;
 
-    return figure;
+    // Free memory
+    if (!keep)
+    {
+        clean_up(figure);
+    }
 }
 
-void plt_axes_type(plt *figure, char *type)
+/*
+ * Streaming series.  The first plt_begin_series opens figure->filename and
+ * writes the axis header, so every axis setting must be made before it.
+ * Points pushed in between are formatted straight into the output and are
+ * neither kept, clipped nor decimated.  Stored series are written in the
+ * order they were added; the picture is completed by plt_save_fig.
+ */
+void plt_begin_series(plt *figure, char *color, char *legend_entry)
 {
-    strcpy(figure->type, type);
+    if (figure->stream_open)
+    {
+        printf("ERROR: plt_begin_series called inside a series\n");
+        exit(1);
+    }
+    if (strcmp(figure->backend, "tikz") == 0)
+    {
+        printf("ERROR: the tikz backend cannot stream series\n");
+        exit(1);
+    }
+    if (figure->n_panels > 0 || figure->parent != NULL)
+    {
+        printf("ERROR: subplots cannot stream series\n");
+        exit(1);
+    }
+
+    if (figure->stream == NULL)
+    {
+        figure->stream = (plt_sink *)PLT_MALLOC(sizeof(plt_sink));
+        sink_open(figure->stream, figure, figure->filename);
+        write_header(figure->stream, figure);
+    }
+
+    // Keep stored series that were added earlier in front of this one
+    write_series(figure->stream, figure, figure->n_streamed);
+    figure->n_streamed = figure->n_series;
+
+    strcpy(figure->stream_legend, legend_entry);
+    figure->stream_open = 1;
+    plot_head(figure->stream, color);
 }
 
-void plt_xlim(plt *figure, double xmin, double xmax)
+void plt_push_points(plt *figure, const double *x, const double *y, int n)
 {
-    figure->xmin = xmin;
-    figure->xmax = xmax;
+    if (!figure->stream_open)
+    {
+        printf("ERROR: plt_push_points called outside a series\n");
+        exit(1);
+    }
+
+    plot_data chunk;
+    chunk.x = plt_col_f64(x);
+    chunk.y = plt_col_f64(y);
+    chunk.length = 0;
+    strcpy(chunk.precision_policy, "");
+    // Pushed points are not known to be integers ahead of time
+    chunk.integral[0] = chunk.integral[1] = 0;
+    series_number(figure, &chunk);
+    for (int i = 0; i < n; i++)
+    {
+        write_point(figure->stream, &chunk, i, &chunk.number);
+    }
 }
 
-void plt_ylim(plt *figure, double ymin, double ymax)
+void plt_end_series(plt *figure)
 {
-    figure->ymin = ymin;
-    figure->ymax = ymax;
+    if (!figure->stream_open)
+    {
+        printf("ERROR: plt_end_series called outside a series\n");
+        exit(1);
+    }
+
+    series_tail(figure->stream, figure->stream_legend);
+    figure->stream_open = 0;
 }
 
-void plt_dims(plt *figure, double width, double height)
+// Completes a streamed figure: remaining series, footer, close
+void finish_stream(plt *figure)
 {
-    figure->width = width;
-    figure->height = height;
+    plt_sink *sink = figure->stream;
+    PLT_STAT(plt_stats *stats = stats_begin(figure);)
+
+    if (figure->stream_open)
+    {
+        plt_end_series(figure);
+    }
+    write_series(sink, figure, figure->n_streamed);
+    write_footer(sink);
+    clean_up(figure);
+
+    sink_close_output(sink);
+    PLT_FREE(sink);
+    PLT_STAT(stats_end(stats);)
 }
 
-void plt_grid(plt *figure)
+void save_to_path(plt *figure, int keep)
 {
-    figure->grid = 1;
+    PLT_STAT(plt_stats *stats = stats_begin(figure);)
+    plt_sink sink;
+    sink_open(&sink, figure, figure->filename);
+    save_figure(figure, &sink, keep);
+
+    // Flush and close the file
+    sink_close_output(&sink);
+    PLT_STAT(stats_end(stats);)
 }
 
-void plt_xlabel(plt *figure, char *xlabel)
+void plt_save_fig(plt *figure)
 {
-    strcpy(figure->xlabel, xlabel);
+    if (figure->stream != NULL)
+    {
+        finish_stream(figure);
+        return;
+    }
+
+    save_to_path(figure, 0);
 }
 
-void plt_ylabel(plt *figure, char *ylabel)
+/*
+ * Saves without freeing the figure, so that it can be changed and saved
+ * again.  Each series keeps its formatted text; a later save reformats
+ * only series that were updated, appended to or touched, and only the new
+ * points of an appended series when every point was written.  Table data
+ * mode writes its side files anew on every save and cannot be kept.  Free
+ * the figure with plt_close.
+ */
+void plt_save_fig_keep(plt *figure)
 {
-    strcpy(figure->ylabel, ylabel);
+    save_to_path(figure, 1);
 }
 
-void plt_legend_pos(plt *figure, char *position)
+void save_to_buffer(plt *figure, char **out, size_t *len, int keep)
 {
-    strcpy(figure->legend_position, position);
+    PLT_STAT(plt_stats *stats = stats_begin(figure);)
+    plt_sink sink;
+    sink_init_memory(&sink);
+    save_figure(figure, &sink, keep);
+
+    *sink_reserve(&sink, 1) = '\0';
+    PLT_STAT(stats_current()->bytes += sink.len;)
+    PLT_STAT(stats_end(stats);)
+    *out = sink.buf;
+    *len = sink.len;
 }
 
-void plt_plot(plt *figure, double *x, double *y, int data_len, char *color,
-              char *legend_entry)
+// Saves into a PLT_MALLOC'd, NUL-terminated string; the caller frees *out
+// with PLT_FREE
+void plt_save_to_buffer(plt *figure, char **out, size_t *len)
 {
-    plot_data *data_in = (plot_data *)malloc(
-        sizeof(*data_in) + sizeof(double) * (size_t)(2 * data_len));
-    data_in->length = data_len;
-    strcpy(data_in->type, "plot");
-    strcpy(data_in->color, color);
-    strcpy(data_in->legend, legend_entry);
-    data_in->next = NULL;
+    save_to_buffer(figure, out, len, 0);
+}
 
-    for (int i = 0; i < data_len; i++)
-    {
-        data_in->data[2 * i] = x[i];
-        data_in->data[2 * i + 1] = y[i];
-    }
+void plt_save_to_buffer_keep(plt *figure, char **out, size_t *len)
+{
+    save_to_buffer(figure, out, len, 1);
+}
 
-    if (figure->data == NULL)
-    {
-        figure->data = data_in;
-    }
-    else
+void sink_flush_file(plt_sink *sink)
+{
+    PLT_STAT(double start = plt_clock();)
+    if (fwrite(sink->buf, 1, sink->len, (FILE *)sink->ctx) != sink->len)
     {
-        plot_data *current = figure->data;
-
-        while (current->next != NULL)
-        {
-            current = current->next;
-        }
-        current->next = data_in;
+        printf("ERROR: fwrite failed: %s\n", strerror(errno));
+        exit(1);
     }
+    PLT_STAT(stats_write(start, sink->len);)
+    sink->len = 0;
 }
 
-void plt_stem(plt *figure, double *x, double *y, int data_len, char *color,
-              char *legend_entry)
+// Saves into an already open stream, which is left open
+void plt_save_to_file(plt *figure, FILE *fp)
 {
-    plot_data *data_in = (plot_data *)malloc(
-        sizeof(*data_in) + sizeof(double) * (size_t)(2 * data_len));
-    data_in->length = data_len;
-    strcpy(data_in->type, "stem");
-    strcpy(data_in->color, color);
-    strcpy(data_in->legend, legend_entry);
-    data_in->next = NULL;
+    PLT_STAT(plt_stats *stats = stats_begin(figure);)
+    plt_sink sink;
+    sink_init(&sink, figure->buffer_size);
+    sink.flush = sink_flush_file;
+    sink.ctx = fp;
+    save_figure(figure, &sink, 0);
+    sink_close(&sink);
+    PLT_STAT(stats_end(stats);)
+}
 
-    for (int i = 0; i < data_len; i++)
-    {
-        data_in->data[2 * i] = x[i];
-        data_in->data[2 * i + 1] = y[i];
-    }
+typedef struct plt_callback
+{
+    plt_write_fn fn;
+    void *userdata;
+} plt_callback;
 
-    if (figure->data == NULL)
+void sink_flush_callback(plt_sink *sink)
+{
+    plt_callback *cb = (plt_callback *)sink->ctx;
+    PLT_STAT(double start = plt_clock();)
+    if (sink->len > 0)
     {
-        figure->data = data_in;
+        cb->fn(sink->buf, sink->len, cb->userdata);
     }
-    else
-    {
-        plot_data *current = figure->data;
+    PLT_STAT(stats_write(start, sink->len);)
+    sink->len = 0;
+}
 
-        while (current->next != NULL)
-        {
-            current = current->next;
-        }
-        current->next = data_in;
-    }
+// Hands the text to fn in chunks of up to plt_buffer_size() bytes
+void plt_save_to_callback(plt *figure, plt_write_fn fn, void *userdata)
+{
+    PLT_STAT(plt_stats *stats = stats_begin(figure);)
+    plt_callback cb = {fn, userdata};
+    plt_sink sink;
+    sink_init(&sink, figure->buffer_size);
+    sink.flush = sink_flush_callback;
+    sink.ctx = &cb;
+    save_figure(figure, &sink, 0);
+    sink_close(&sink);
+    PLT_STAT(stats_end(stats);)
 }
 
-void add_plot(FILE *fp, plot_data *data_in)
+// New empty figure with every setting of style (axes, labels, limits,
+// precision, modes).  Clones live in the same arena as style, if any.
+plt *plt_clone(const plt *style, char *filename)
 {
+    plt *source = (plt *)style;
+    plt *figure = (plt *)plt_alloc(source, sizeof(*figure));
+
+    // Render the style's header once so that every clone starts with it
+    cache_header(source);
+    *figure = *style;
+    strcpy(figure->filename, filename);
+    reset_contents(figure);
+    figure->header = (char *)PLT_MALLOC(style->header_len);
+    memcpy(figure->header, style->header, style->header_len);
 
-    fprintf(fp, "\\addplot [\n");
+    return figure;
+}
 
-    if (strcmp(data_in->color, "") != 0)
+/*
+ * Splits figure into a rows x cols grid of axes, drawn as one pgfplots
+ * groupplot (the document needs \usepgfplotslibrary{groupplots}).  Each
+ * panel from plt_subplot is a figure of its own for series, limits and
+ * labels, starting from the settings figure has now.  Saving figure
+ * writes every panel into its file and frees them with it; the panels
+ * are never saved themselves.  Their side files are named after
+ * "<filename>_p<i>".
+ */
+void plt_subplots(plt *figure, int rows, int cols)
+{
+    if (rows < 1 || cols < 1)
+    {
+        printf("ERROR: subplot grid must be at least 1 by 1\n");
+        exit(1);
+    }
+    if (figure->n_panels > 0 || figure->n_series > 0 ||
+        figure->parent != NULL || figure->stream != NULL)
     {
-        fprintf(fp, "color=%s,\n", data_in->color);
+        printf("ERROR: plt_subplots needs a figure without series\n");
+        exit(1);
     }
 
-    /* "mark=%s, " */
-    /* "mark options={scale=1.5}, " */
-    fprintf(fp, "line width=1pt] coordinates {\n");
+    const char *slash = strrchr(figure->filename, '/');
+    const char *dot = strrchr(slash != NULL ? slash : figure->filename, '.');
+    int stem = dot != NULL ? (int)(dot - figure->filename)
+                           : (int)strlen(figure->filename);
+    int n = rows * cols;
 
-    // Write x and y values to the plot
-    for (int i = 0; i < data_in->length; ++i)
+    figure->panels = (plt **)plt_alloc(figure, sizeof(plt *) * (size_t)n);
+    for (int i = 0; i < n; i++)
     {
-        fprintf(fp, "    (%f,%f)\n", data_in->data[2 * i],
-                data_in->data[2 * i + 1]);
+        plt *panel = (plt *)plt_alloc(figure, sizeof(*panel));
+        *panel = *figure;
+        reset_contents(panel);
+        panel->header = NULL;
+        panel->header_len = 0;
+        panel->parent = figure;
+        snprintf(panel->filename, sizeof(panel->filename), "%.*s_p%d%s",
+                 stem, figure->filename, i, dot != NULL ? dot : "");
+        figure->panels[i] = panel;
     }
+    figure->n_panels = n;
+    figure->panel_cols = cols;
+}
 
-    fprintf(fp, "};\n");
-    if (strcmp(data_in->legend, "") != 0)
+// Panel i of plt_subplots, counted row by row from the top left
+plt *plt_subplot(plt *figure, int i)
+{
+    if (i < 0 || i >= figure->n_panels)
     {
-        fprintf(fp, "\\addlegendentry{%s}\n", data_in->legend);
+        printf("ERROR: subplot %d out of range (%d panels)\n", i,
+               figure->n_panels);
+        exit(1);
     }
+    return figure->panels[i];
 }
 
-void add_stem(FILE *fp, plot_data *data_in)
+typedef struct plt_batch
+{
+    plt **figures;
+    int n;
+    int n_slots;
+} plt_batch;
+
+void batch_task(void *ctx, int task)
 {
+    plt_batch *batch = (plt_batch *)ctx;
+    plt_sink out; // reused for every figure of this task
+    int begin = (int)((long)batch->n * task / batch->n_slots);
+    int end = (int)((long)batch->n * (task + 1) / batch->n_slots);
 
-    fprintf(
-        fp,
-        "\\addplot +[ycomb, %s, thick, mark options={fill}] coordinates {\n",
-        data_in->color);
+    sink_init_memory(&out);
 
-    // Write x and y values to the plot
-    for (int i = 0; i < data_in->length; ++i)
+    for (int i = begin; i < end; i++)
     {
-        fprintf(fp, "    (%f,%f)\n", data_in->data[2 * i],
-                data_in->data[2 * i + 1]);
+        plt *figure = batch->figures[i];
+
+        if (figure->stream != NULL)
+        {
+            printf("ERROR: streamed figures are saved with plt_save_fig\n");
+            exit(1);
+        }
+
+        if (compressed(figure))
+        {
+            // Each gzip stream carries its own state: no buffer reuse
+            figure->threads = 1;
+            save_to_path(figure, 0);
+            continue;
+        }
+
+        PLT_STAT(plt_stats *stats = stats_begin(figure);)
+        int fd = open_output(figure->filename);
+        out.fd = fd;
+        out.flush = figure->buffer_size != 0 ? sink_flush_fd : NULL;
+        out.len = 0;
+        sink_reserve(&out, figure->buffer_size);
+
+        figure->threads = 1;
+        write_figure(&out, figure);
+        clean_up(figure);
+
+        sink_flush_fd(&out);
+        close(fd);
+        PLT_STAT(stats_end(stats);)
     }
 
-    fprintf(fp, "};\n");
-    if (strcmp(data_in->legend, "") != 0)
+    PLT_FREE(out.buf);
+}
+
+/*
+ * Saves and frees n figures.  They are split between the thread count of
+ * the first figure (clones inherit it from their style); each thread
+ * reuses one output buffer throughout, and clones of one style share its
+ * pre-rendered axis header.
+ */
+void plt_save_batch(plt **figures, int n)
+{
+    plt_batch batch;
+
+    if (n <= 0)
     {
-        fprintf(fp, "\\addlegendentry{%s}\n", data_in->legend);
+        return;
     }
+    batch.figures = figures;
+    batch.n = n;
+    batch.n_slots = figures[0]->threads < n ? figures[0]->threads : n;
+    parallel_for(batch.n_slots, batch_task, &batch, batch.n_slots);
 }
 
-void write_data(FILE *fp, plot_data *data_in)
+/*
+ * Background saves.  plt_save_fig_async queues the figure and returns; one
+ * worker thread, started when the queue fills and gone when it drains,
+ * saves the queued figures in order with each figure's own thread count,
+ * then calls back with the filename.  The queue owns a figure until its
+ * callback, so the caller must not touch it after queueing.
+ */
+typedef void (*plt_done_fn)(const char *filename, void *userdata);
+
+typedef struct plt_async_job
+{
+    struct plt_async_job *next;
+    plt *figure;
+    plt_done_fn done;
+    void *userdata;
+    char filename[sizeof(((plt *)0)->filename)];
+} plt_async_job;
+
+typedef struct plt_async_queue
 {
-    plot_data *current = data_in;
+    pthread_mutex_t lock;
+    // Signalled when the worker exits after draining the queue
+    pthread_cond_t idle;
+    plt_async_job *head;
+    plt_async_job *tail;
+    int running;
+} plt_async_queue;
+
+static plt_async_queue plt_async = {PTHREAD_MUTEX_INITIALIZER,
+                                    PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
 
-    while (current != NULL)
+void *async_worker(void *arg)
+{
+    (void)arg;
+    for (;;)
     {
-        if (strcmp(current->type, "plot") == 0)
+        pthread_mutex_lock(&plt_async.lock);
+        plt_async_job *job = plt_async.head;
+        if (job == NULL)
         {
-            add_plot(fp, current);
+            plt_async.running = 0;
+            pthread_cond_broadcast(&plt_async.idle);
+            pthread_mutex_unlock(&plt_async.lock);
+            return NULL;
         }
-        else if (strcmp(current->type, "stem") == 0)
+        plt_async.head = job->next;
+        if (plt_async.head == NULL)
         {
-            add_stem(fp, current);
+            plt_async.tail = NULL;
         }
-        else
+        pthread_mutex_unlock(&plt_async.lock);
+
+        plt_save_fig(job->figure);
+        if (job->done != NULL)
         {
-            printf("ERROR:  %s invalid plot type!\n", current->type);
-            exit(1);
+            job->done(job->filename, job->userdata);
         }
-        current = current->next;
+        PLT_FREE(job);
     }
 }
 
-void clean_up(plt *figure)
+// Saves and frees figure on the background worker, then calls done (if
+// not NULL) with its filename and userdata there
+void plt_save_fig_async(plt *figure, plt_done_fn done, void *userdata)
 {
-    plot_data *current = figure->data;
-    plot_data *previous;
+    plt_async_job *job = (plt_async_job *)PLT_MALLOC(sizeof(*job));
+    job->next = NULL;
+    job->figure = figure;
+    job->done = done;
+    job->userdata = userdata;
+    strcpy(job->filename, figure->filename);
 
-    while (current != NULL)
+    pthread_mutex_lock(&plt_async.lock);
+    if (plt_async.tail != NULL)
+    {
+        plt_async.tail->next = job;
+    }
+    else
     {
-        previous = current;
-        current = current->next;
-        free(previous);
-        previous = NULL;
+        plt_async.head = job;
+    }
+    plt_async.tail = job;
+    if (!plt_async.running)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, async_worker, NULL) != 0)
+        {
+            printf("ERROR: cannot start the save worker\n");
+            exit(1);
+        }
+        pthread_detach(worker);
+        plt_async.running = 1;
     }
+    pthread_mutex_unlock(&plt_async.lock);
+}
 
-    free(figure);
-    figure = NULL;
+// Returns once every queued figure is saved and its callback has returned
+void plt_wait_all(void)
+{
+    pthread_mutex_lock(&plt_async.lock);
+    while (plt_async.running)
+    {
+        pthread_cond_wait(&plt_async.idle, &plt_async.lock);
+    }
+    pthread_mutex_unlock(&plt_async.lock);
 }
 
-void plt_save_fig(plt *figure)
+/*
+ * Binary snapshot written by plt_dump: a plt_dump_header, one
+ * plt_dump_series per series, then the same for every subplot panel in
+ * order, then the double arrays they reference by byte offset.  The layout
+ * is that of the writing machine, checked on load through the magic,
+ * version and endian fields.
+ */
+#define PLT_DUMP_MAGIC "CPLTGIBB"
+#define PLT_DUMP_VERSION 7
+#define PLT_DUMP_ENDIAN 0x01020304u
+
+typedef struct plt_dump_header
 {
-    FILE *fp = fopen(figure->filename, "w");
-    fprintf(fp, "\\begin{tikzpicture}\n");
-    fprintf(fp, "\\begin{axis}\n");
-    fprintf(fp, "[\n");
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    char filename[100];
+    char type[10];
+    char xlabel[100];
+    char ylabel[100];
+    char legend_position[20];
+    char decimate[10];
+    char data_mode[10];
+    char precision_policy[10];
+    char autoscale[10];
+    char backend[10];
+    double xmin;
+    double xmax;
+    double ymin;
+    double ymax;
+    double width;
+    double height;
+    double dpi;
+    double tolerance;
+    int32_t grid;
+    int32_t precision;
+    int32_t n_series;
+    // Subplot grid of the figure; 0 panels for a single axis and in the
+    // headers of the panels themselves
+    int32_t n_panels;
+    int32_t panel_cols;
+    int32_t reserved;
+} plt_dump_header;
 
-    // Fix label locations for "center" case
-    if (strcmp(figure->type, "center") == 0)
+typedef struct plt_dump_series
+{
+    char type[100];
+    char color[20];
+    char legend[50];
+    char decimate[10];
+    char precision_policy[10];
+    int32_t length;
+    // 1 when x is start + i * step and x_offset is unused
+    int32_t uniform;
+    double start;
+    double step;
+    uint64_t x_offset;
+    uint64_t y_offset;
+    // Opacity of a rasterized series, 0 when its points are written
+    double raster;
+} plt_dump_series;
+
+// Appends n values of column as raw doubles
+void dump_column(plt_sink *sink, const plt_column *column, int n)
+{
+    for (int i = 0; i < n; i++)
     {
-        fprintf(fp, "axis lines=center,\n"
-                    "axis x line = middle,\n"
-                    "every axis x label/.style={\n"
-                    "at={(ticklabel* cs:1.0)},\n"
-                    "anchor=west,\n"
-                    "},\n"
-                    "axis y line = left,\n"
-                    "every axis y label/.style={\n"
-                    "at={(ticklabel* cs:1.0)},\n"
-                    "anchor=south,\n"
-                    "},");
+        double value = column_at(column, i);
+        sink_write(sink, (const char *)&value, sizeof(value));
     }
-    else if (strcmp(figure->type, "standard") == 0)
+}
+
+void dump_header(const plt *figure, plt_dump_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, PLT_DUMP_MAGIC, sizeof(header->magic));
+    header->version = PLT_DUMP_VERSION;
+    header->endian = PLT_DUMP_ENDIAN;
+    strcpy(header->filename, figure->filename);
+    strcpy(header->type, figure->type);
+    strcpy(header->xlabel, figure->xlabel);
+    strcpy(header->ylabel, figure->ylabel);
+    strcpy(header->legend_position, figure->legend_position);
+    strcpy(header->decimate, figure->decimate);
+    strcpy(header->data_mode, figure->data_mode);
+    strcpy(header->precision_policy, figure->precision_policy);
+    strcpy(header->autoscale, figure->autoscale);
+    strcpy(header->backend, figure->backend);
+    header->xmin = figure->xmin;
+    header->xmax = figure->xmax;
+    header->ymin = figure->ymin;
+    header->ymax = figure->ymax;
+    header->width = figure->width;
+    header->height = figure->height;
+    header->dpi = figure->dpi;
+    header->tolerance = figure->tolerance;
+    header->grid = figure->grid;
+    header->precision = figure->precision;
+    header->n_series = figure->n_series;
+    header->n_panels = figure->n_panels;
+    header->panel_cols = figure->panel_cols;
+}
+
+// Writes settings and series of figure to path; the figure is unchanged
+void plt_dump(plt *figure, const char *path)
+{
+    // The figure and its panels, each with its series
+    int n_parts = figure->n_panels + 1;
+    plt **parts = (plt **)PLT_MALLOC(sizeof(plt *) * (size_t)n_parts);
+    int n = 0;
+    for (int p = 0; p < n_parts; p++)
     {
+        parts[p] = p == 0 ? figure : figure->panels[p - 1];
+        n += parts[p]->n_series;
     }
-    else
+
+    plot_data **series =
+        (plot_data **)PLT_MALLOC(sizeof(plot_data *) * (size_t)(n > 0 ? n : 1));
+    size_t records_size = sizeof(plt_dump_series) * (size_t)(n > 0 ? n : 1);
+    plt_dump_series *records = (plt_dump_series *)PLT_MALLOC(records_size);
+    memset(records, 0, records_size);
+    for (int p = 0, i = 0; p < n_parts; p++)
     {
-        printf("ERROR: please set axis type  'standard' or "
-               "'center'\n");
-        exit(1);
+        for (int k = 0; k < parts[p]->n_series; k++)
+        {
+            series[i++] = parts[p]->series[k];
+        }
     }
 
-    if ((figure->xmin != 0.) || (figure->xmax != 0.))
+    // Lay out the arrays; series drawn over the same x array share it
+    plt_dump_header header;
+    uint64_t start = sizeof(header) * (uint64_t)n_parts +
+                     sizeof(*records) * (uint64_t)n;
+    uint64_t offset = start;
+    for (int i = 0; i < n; i++)
     {
-        fprintf(fp, "xmin = %f, xmax = %f,\n", figure->xmin, figure->xmax);
+        plot_data *current = series[i];
+        plt_dump_series *record = &records[i];
+
+        strcpy(record->type, current->type);
+        strcpy(record->color, current->color);
+        strcpy(record->legend, current->legend);
+        strcpy(record->decimate, current->decimate);
+        strcpy(record->precision_policy, current->precision_policy);
+        record->length = current->length;
+        record->uniform = current->x.dtype == PLT_UNIFORM;
+        record->start = current->x.start;
+        record->step = current->x.step;
+        record->raster = current->raster;
+
+        record->x_offset = record->uniform ? 0 : UINT64_MAX;
+        for (int j = 0; j < i && !record->uniform; j++)
+        {
+            if (same_column(&series[j]->x, &current->x) &&
+                series[j]->length >= current->length)
+            {
+                record->x_offset = records[j].x_offset;
+                break;
+            }
+        }
+        if (record->x_offset == UINT64_MAX && !record->uniform)
+        {
+            record->x_offset = offset;
+            offset += sizeof(double) * (uint64_t)current->length;
+        }
+        record->y_offset = offset;
+        offset += sizeof(double) * (uint64_t)current->length;
     }
 
-    if ((figure->ymin != 0.) || (figure->ymax != 0.))
+    int fd = open_output(path);
+    plt_sink sink;
+    sink_init_fd(&sink, fd, figure->buffer_size);
+    for (int p = 0, i = 0; p < n_parts; p++)
     {
-        fprintf(fp, "ymin = %f, ymax = %f,\n", figure->ymin, figure->ymax);
+        dump_header(parts[p], &header);
+        sink_write(&sink, (const char *)&header, sizeof(header));
+        sink_write(&sink, (const char *)&records[i],
+                   sizeof(*records) * (size_t)parts[p]->n_series);
+        i += parts[p]->n_series;
     }
 
-    if (figure->grid == 1)
+    uint64_t written = start;
+    for (int i = 0; i < n; i++)
     {
-        fprintf(fp, "grid=major,\n");
+        if (!records[i].uniform && records[i].x_offset == written)
+        {
+            dump_column(&sink, &series[i]->x, records[i].length);
+            written += sizeof(double) * (uint64_t)records[i].length;
+        }
+        dump_column(&sink, &series[i]->y, records[i].length);
+        written += sizeof(double) * (uint64_t)records[i].length;
     }
 
-    if (figure->width != 0.)
+    sink_close(&sink);
+    close(fd);
+    PLT_FREE(records);
+    PLT_FREE(series);
+    PLT_FREE(parts);
+}
+
+// Copies a fixed-size text field that may lack its terminator
+void copy_text(char *dst, const char *src, size_t size)
+{
+    memcpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+}
+
+int dump_range_ok(uint64_t offset, int32_t length, size_t size)
+{
+    return length >= 0 && offset % sizeof(double) == 0 && offset <= size &&
+           (uint64_t)length <= (size - offset) / sizeof(double);
+}
+
+// 1 if a header and its series records start at offset and lie within
+// the size bytes of the snapshot at base; *end is then where they stop
+int dump_part_ok(const char *base, size_t size, size_t offset, size_t *end)
+{
+    if (size - offset < sizeof(plt_dump_header))
     {
-        fprintf(fp, "width=%f cm,\n", figure->width);
+        return 0;
     }
 
-    if (figure->height != 0.)
+    const plt_dump_header *header = (const plt_dump_header *)(base + offset);
+    const plt_dump_series *records =
+        (const plt_dump_series *)(base + offset + sizeof(*header));
+    size_t room = size - offset - sizeof(*header);
+    int valid = memcmp(header->magic, PLT_DUMP_MAGIC, 8) == 0 &&
+                header->version == PLT_DUMP_VERSION &&
+                header->endian == PLT_DUMP_ENDIAN && header->n_series >= 0 &&
+                (size_t)header->n_series <= room / sizeof(*records) &&
+                // Settings within what plt_precision and plt_tolerance take,
+                // and a usable dpi
+                header->precision >= 0 &&
+                header->precision <= PLT_MAX_PRECISION &&
+                header->dpi > 0. && isfinite(header->dpi) &&
+                header->tolerance >= 0. && isfinite(header->tolerance);
+
+    for (int i = 0; valid && i < header->n_series; i++)
     {
-        fprintf(fp, "height=%f cm,\n", figure->height);
+        valid = dump_range_ok(records[i].y_offset, records[i].length, size) &&
+                (records[i].uniform ||
+                 dump_range_ok(records[i].x_offset, records[i].length, size));
     }
+    *end = offset + sizeof(*header) +
+           sizeof(*records) * (size_t)(valid ? header->n_series : 0);
+    return valid;
+}
 
-    if (strcmp(figure->xlabel, "") != 0)
+// Restores the settings of a header and adds its series, which read from
+// the snapshot at base
+void load_part(plt *figure, const char *base, size_t offset)
+{
+    const plt_dump_header *header = (const plt_dump_header *)(base + offset);
+    const plt_dump_series *records =
+        (const plt_dump_series *)(base + offset + sizeof(*header));
+
+    copy_text(figure->filename, header->filename, sizeof(figure->filename));
+    copy_text(figure->type, header->type, sizeof(figure->type));
+    copy_text(figure->xlabel, header->xlabel, sizeof(figure->xlabel));
+    copy_text(figure->ylabel, header->ylabel, sizeof(figure->ylabel));
+    copy_text(figure->legend_position, header->legend_position,
+              sizeof(figure->legend_position));
+    copy_text(figure->decimate, header->decimate, sizeof(figure->decimate));
+    copy_text(figure->data_mode, header->data_mode, sizeof(figure->data_mode));
+    copy_text(figure->precision_policy, header->precision_policy,
+              sizeof(figure->precision_policy));
+    copy_text(figure->autoscale, header->autoscale, sizeof(figure->autoscale));
+    copy_text(figure->backend, header->backend, sizeof(figure->backend));
+    figure->xmin = header->xmin;
+    figure->xmax = header->xmax;
+    figure->ymin = header->ymin;
+    figure->ymax = header->ymax;
+    figure->width = header->width;
+    figure->height = header->height;
+    figure->dpi = header->dpi;
+    figure->tolerance = header->tolerance;
+    figure->grid = (unsigned char)header->grid;
+    figure->precision = header->precision;
+
+    plt_reserve_series(figure, header->n_series);
+    for (int i = 0; i < header->n_series; i++)
     {
-        fprintf(fp, "xlabel=%s,\n", figure->xlabel);
+        const plt_dump_series *record = &records[i];
+        const double *x = (const double *)(base + record->x_offset);
+        const double *y = (const double *)(base + record->y_offset);
+        plt_column x_column = record->uniform
+                                  ? plt_col_uniform(record->start, record->step)
+                                  : plt_col_f64(x);
+        plot_data *series = add_columns(figure, "", x_column, plt_col_f64(y),
+                                        record->length, "", "", 0);
+        copy_text(series->type, record->type, sizeof(series->type));
+        copy_text(series->color, record->color, sizeof(series->color));
+        copy_text(series->legend, record->legend, sizeof(series->legend));
+        copy_text(series->decimate, record->decimate,
+                  sizeof(series->decimate));
+        copy_text(series->precision_policy, record->precision_policy,
+                  sizeof(series->precision_policy));
+        series->raster = record->raster;
     }
+}
 
-    if (strcmp(figure->ylabel, "") != 0)
+/*
+ * Maps a snapshot written by plt_dump and returns it as a figure whose
+ * series, subplot panels included, read straight from the mapping.  The
+ * mapping is released when the figure is saved or closed.  Returns NULL if
+ * path is not a valid snapshot.
+ */
+plt *plt_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
     {
-        fprintf(fp, "ylabel=%s,\n", figure->ylabel);
+        return NULL;
     }
 
-    if (strcmp(figure->legend_position, "") != 0)
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        (size_t)info.st_size < sizeof(plt_dump_header))
     {
-        fprintf(fp, "legend pos=%s,\n", figure->legend_position);
+        close(fd);
+        return NULL;
     }
 
-    fprintf(fp, "]\n");
+    size_t size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
 
-    write_data(fp, figure->data);
+    const char *base = (const char *)mapping;
+    const plt_dump_header *header = (const plt_dump_header *)base;
+    size_t end = 0;
+    int valid = dump_part_ok(base, size, 0, &end);
+    int n_panels = valid ? header->n_panels : 0;
+    int cols = valid ? header->panel_cols : 0;
 
-    fprintf(fp, "\\end{axis}\n");
-    fprintf(fp, "\\end{tikzpicture}\n");
+    // Series of a figure with subplots belong to its panels
+    valid = valid && n_panels >= 0 &&
+            (size_t)n_panels <= (size - end) / sizeof(*header) &&
+            (n_panels == 0 || (cols > 0 && n_panels % cols == 0 &&
+                               header->n_series == 0));
+    size_t *parts = (size_t *)PLT_MALLOC(sizeof(size_t) *
+                                         (size_t)(valid ? n_panels + 1 : 1));
+    parts[0] = 0;
+    for (int p = 1; valid && p <= n_panels; p++)
+    {
+        parts[p] = end;
+        valid = dump_part_ok(base, size, end, &end) &&
+                ((const plt_dump_header *)(base + parts[p]))->n_panels == 0;
+    }
+    if (!valid)
+    {
+        PLT_FREE(parts);
+        munmap(mapping, size);
+        return NULL;
+    }
 
-    // Free memory
-    clean_up(figure);
+    plt *figure = plt_figure("");
+    load_part(figure, base, 0);
+    if (n_panels > 0)
+    {
+        plt_subplots(figure, n_panels / cols, cols);
+        for (int p = 1; p <= n_panels; p++)
+        {
+            load_part(figure->panels[p - 1], base, parts[p]);
+        }
+    }
+    figure->mapping = mapping;
+    figure->mapping_len = size;
 
-    // Close the file
-    fclose(fp);
+    PLT_FREE(parts);
+    return figure;
 }
 
 #endif /* CPLOTGIBB_H */